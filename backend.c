@@ -139,6 +139,10 @@ extern int gettimeofday(struct timeval *, struct timezone *);
 # include <unistd.h>
 #endif
 
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
 #include "common.h"
 #include "frontend.h"
 #include "backend.h"
@@ -516,10 +520,11 @@ AppData appData;
 
 Board boards[MAX_MOVES];
 /* [HGM] Following 7 needed for accurate legality tests: */
-signed char  castlingRank[BOARD_FILES]; // and corresponding ranks
-unsigned char initialRights[BOARD_FILES];
+THREAD_LOCAL signed char  castlingRank[BOARD_FILES]; // and corresponding ranks
+THREAD_LOCAL unsigned char initialRights[BOARD_FILES];
 int   nrCastlingRights; // For TwoKings, or to implement castling-unknown status
-int   initialRulePlies, FENrulePlies;
+int   initialRulePlies;
+THREAD_LOCAL int FENrulePlies; // [HGM] parallel build: game-list threads parse FENs too
 FILE  *serverMoves = NULL; // next two for broadcasting (/serverMoves option)
 int loadFlag = 0;
 Boolean shuffleOpenings;
@@ -4675,6 +4680,7 @@ ParseBoard12 (char *string)
     }
     CopyBoard(boards[moveNum], board);
     boards[moveNum][HOLDINGS_SET] = 0; // [HGM] indicate holdings not set
+    boards[moveNum][KEY_STATE] = EmptySquare; // [HGM] hash: and key not known
     if (moveNum == 0) {
 	startedFromSetupPosition =
 	  !CompareBoards(board, initialPosition);
@@ -5364,8 +5370,8 @@ UploadGameEvent ()
     SendToICS(ics_type == ICS_ICC ? "tag result Game in progress\n" : "commit\n");
 }
 
-int killX = -1, killY = -1, kill2X = -1, kill2Y = -1; // [HGM] lion: used for passing e.p. capture square to MakeMove
-int legNr = 1;
+THREAD_LOCAL int killX = -1, killY = -1, kill2X = -1, kill2Y = -1; // [HGM] lion: used for passing e.p. capture square to MakeMove
+THREAD_LOCAL int legNr = 1;
 
 void
 CoordsToComputerAlgebraic (int rf, int ff, int rt, int ft, char promoChar, char move[9])
@@ -6047,6 +6053,8 @@ SetCharTableEsc (unsigned char *table, const char * map, char * escapes)
     int result = FALSE; int NrPieces;
     unsigned char partner[EmptySquare];
 
+    FlushLegalMoves(); // [HGM] batch: the moves of '~' pieces depend on the table
+
     if( map != NULL && (NrPieces=ptclen(map, escapes)) <= (int) EmptySquare
                     && NrPieces >= 12 && !(NrPieces&1)) {
         int i, ii, offs, j = 0; /* [HGM] Accept even length from 12 to 88 */
@@ -6188,6 +6196,7 @@ InitPosition (int redraw)
       initialPosition[CASTLING][i] = initialRights[i] = NoRights; /* but no rights yet */
     initialPosition[EP_STATUS] = EP_NONE;
     initialPosition[TOUCHED_W] = initialPosition[TOUCHED_B] = 0;
+    initialPosition[KEY_STATE] = EmptySquare; // [HGM] hash: key computed on first use
     SetCharTableEsc(pieceToChar, "PNBRQ...........Kpnbrq...........k", SUFFIXES);
     if(startVariant == gameInfo.variant) // [HGM] nicks: enable nicknames in original variant
          SetCharTable(pieceNickName, appData.pieceNickNames);
@@ -6466,6 +6475,15 @@ InitPosition (int redraw)
     }
     if(*appData.men) LoadPieceDesc(appData.men);
 
+    switch(gameInfo.variant) { // [HGM] speed: variants with only orthodox moves can use the dedicated 8x8 generator
+      case VariantNormal: case VariantFischeRandom: case VariantWildCastle: case VariantNoCastle:
+      case VariantLosers: case VariantSuicide: case VariantGiveaway: case VariantTwoKings:
+      case VariantKriegspiel: case VariantAtomic: case Variant3Check:
+	fastGen = TRUE; break;
+      default:
+	fastGen = FALSE;
+    }
+
     CopyBoard(boards[0], initialPosition);
 
     if(oldx != gameInfo.boardWidth ||
@@ -8149,14 +8167,94 @@ TourneyStandings (int display)
     return p;
 }
 
+// [HGM] pieces: list of the occupied squares of the board proper, so that sparse boards need not be scanned square
+//       by square. Each thread keeps the lists of the last few boards it needed one for, identified by
+//       their placement key, and ApplyMove carries a list along to the board it produces. Boards can be
+//       edited behind the back of the key, though, so a list is checked against the board before use.
+
+#define NR_LISTS 4
+
+typedef struct {
+    u64 key;
+    int n;
+    unsigned char r[BOARD_RANKS*BOARD_FILES], f[BOARD_RANKS*BOARD_FILES];
+    ChessSquare piece[BOARD_RANKS*BOARD_FILES];
+    short index[BOARD_RANKS][BOARD_FILES]; // where the piece on a square is listed, -1 if empty
+} PieceList;
+
+static THREAD_LOCAL PieceList pieceLists[NR_LISTS];
+static THREAD_LOCAL int listsUsed, nextList;
+
+static PieceList *
+FindPieceList (u64 key)
+{
+    int i;
+    for(i=0; i<listsUsed; i++) if(pieceLists[i].key == key) return pieceLists + i;
+    return NULL;
+}
+
+static void
+AddPiece (PieceList *pl, ChessSquare p, int r, int f)
+{
+    int n = pl->n++;
+    pl->r[n] = r; pl->f[n] = f; pl->piece[n] = p;
+    pl->index[r][f] = n;
+}
+
+static void
+RemovePiece (PieceList *pl, int r, int f)
+{   // the last piece of the list takes the place of the removed one
+    int i = pl->index[r][f], n = --pl->n;
+    pl->r[i] = pl->r[n]; pl->f[i] = pl->f[n]; pl->piece[i] = pl->piece[n];
+    pl->index[pl->r[i]][pl->f[i]] = i;
+    pl->index[r][f] = -1;
+}
+
+static PieceList *
+Pieces (Board board)
+{   // list of the pieces on the given board
+    u64 key = PlacementKey(board);
+    PieceList *pl = FindPieceList(key);
+    int i, r, f;
+    if(pl) { // check it (which still trusts the key on pieces added to empty squares)
+	for(i=0; i<pl->n; i++) if(board[pl->r[i]][pl->f[i]] != pl->piece[i]) break;
+	if(i >= pl->n) return pl;
+    } else {
+	if(listsUsed < NR_LISTS) listsUsed++;
+	pl = pieceLists + nextList; nextList = (nextList + 1) % NR_LISTS;
+    }
+    pl->key = key; pl->n = 0;
+    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
+	pl->index[r][f] = -1;
+	if(board[r][f] != EmptySquare) AddPiece(pl, board[r][f], r, f);
+    }
+    return pl;
+}
+
+static void
+MovePieces (u64 oldKey, u64 newKey, ChessSquare old[], Board board, int sq[][2], int n)
+{   // ApplyMove changed the listed squares, which had the given contents: move the list of the old position along
+    PieceList *pl = FindPieceList(oldKey);
+    ChessSquare p;
+    int i;
+    if(!pl) return;
+    for(i=0; i<n; i++) if((p = board[sq[i][0]][sq[i][1]]) != old[i]) {
+	if(pl->index[sq[i][0]][sq[i][1]] >= 0) RemovePiece(pl, sq[i][0], sq[i][1]);
+	if(p != EmptySquare) AddPiece(pl, p, sq[i][0], sq[i][1]);
+    }
+    pl->key = newKey;
+}
+
 void
 Count (Board board, int pCnt[], int *nW, int *nB, int *wStale, int *bStale, int *bishopColor)
 {	// count all piece types
-	int p, f, r;
+	PieceList *pl = Pieces(board);
+	int p, f, r, i;
 	*nB = *nW = *wStale = *bStale = *bishopColor = 0;
 	for(p=WhitePawn; p<=EmptySquare; p++) pCnt[p] = 0;
-	for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
-		p = board[r][f];
+	pCnt[EmptySquare] = BOARD_HEIGHT*(BOARD_RGHT - BOARD_LEFT) - pl->n;
+	for(i=0; i<pl->n; i++) {
+		p = pl->piece[i]; r = pl->r[i]; f = pl->f[i];
 		pCnt[p]++;
 		if(p == WhitePawn && r == BOARD_HEIGHT-1) (*wStale)++; else
 		if(p == BlackPawn && r == 0) (*bStale)++; // count last-Rank Pawns (XQ) separately
@@ -8450,7 +8548,8 @@ Adjudicate (ChessProgramState *cps)
                         (signed char)boards[k+2][EP_STATUS] <= EP_NONE && (signed char)boards[k+1][EP_STATUS] <= EP_NONE);
                     k-=2)
                 {   int rights=0;
-                    if(CompareBoards(boards[k], boards[forwardMostMove])) {
+                    if(PlacementKey(boards[k]) == PlacementKey(boards[forwardMostMove]) && // [HGM] hash: cheap pre-test
+                       CompareBoards(boards[k], boards[forwardMostMove])) {
                         /* compare castling rights */
                         if( boards[forwardMostMove][CASTLING][2] != boards[k][CASTLING][2] &&
                              (boards[k][CASTLING][0] != NoRights || boards[k][CASTLING][1] != NoRights) )
@@ -8597,18 +8696,20 @@ static int egbbCode[] = { 6, 5, 4, 3, 2, 1 };
 static int
 BitbaseProbe ()
 {
-    int pieces[10], squares[10], cnt=0, r, f, res;
+    int pieces[10], squares[10], cnt=0, r, f, i, res;
+    PieceList *pl;
     static int loaded;
     static PPROBE_EGBB probeBB;
     if(!appData.testLegality) return 10;
     if(BOARD_HEIGHT != 8 || BOARD_RGHT-BOARD_LEFT != 8) return 12;
     if(gameInfo.holdingsSize && gameInfo.variant != VariantSuper && gameInfo.variant != VariantSChess) return 12;
     if(loaded == 2 && forwardMostMove < 2) loaded = 0; // retry on new game
-    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
-	ChessSquare piece = boards[forwardMostMove][r][f];
+    pl = Pieces(boards[forwardMostMove]);
+    for(i=0; i<pl->n; i++) {
+	ChessSquare piece = pl->piece[i];
 	int black = (piece >= BlackPawn);
 	int type = piece - black*BlackPawn;
-	if(piece == EmptySquare) continue;
+	r = pl->r[i]; f = pl->f[i];
 	if(type != WhiteKing && type > WhiteQueen) return 12; // unorthodox piece
 	if(type == WhiteKing) type = WhiteQueen + 1;
 	type = egbbCode[type];
@@ -9181,8 +9282,8 @@ FakeBookMove: // [HGM] book: we jump here to simulate machine moves after book h
                                                && gameInfo.variant != VariantFairy    ) return;
       if(piece < EmptySquare) {
         pieceDefs = TRUE;
-        ASSIGN(pieceDesc[piece], buf1);
-        if((ID & 32) == 0 && p[1] == '&') { ASSIGN(pieceDesc[WHITE_TO_BLACK piece], buf1); }
+        ASSIGN(pieceDesc[piece], buf1); CompilePieceDesc(piece);
+        if((ID & 32) == 0 && p[1] == '&') { ASSIGN(pieceDesc[WHITE_TO_BLACK piece], buf1); CompilePieceDesc(WHITE_TO_BLACK piece); }
       }
       return;
     }
@@ -10209,8 +10310,8 @@ ParseGameHistory (char *game)
 
 
 /* Apply a move to the given board  */
-void
-ApplyMove (int fromX, int fromY, int toX, int toY, int promoChar, Board board)
+static void
+ApplyMoveToBoard (int fromX, int fromY, int toX, int toY, int promoChar, Board board)
 {
   ChessSquare captured = board[toY][toX], piece, pawn, king, killed, killed2; int p, rookX, oldEP, epRank, berolina = 0;
   int promoRank = gameInfo.variant == VariantMakruk || gameInfo.variant == VariantGrand || gameInfo.variant == VariantChuChess ? 3 : 1;
@@ -10579,6 +10680,195 @@ ApplyMove (int fromX, int fromY, int toX, int toY, int promoChar, Board board)
     }
 }
 
+static int
+AddKeySquare (int sq[][2], int n, int first, int y, int x)
+{   // append square to list, if on the board and not already listed (where ranks first to n hold single squares)
+    int i;
+    if(y < 0 || y >= BOARD_HEIGHT || x < BOARD_LEFT || x >= BOARD_RGHT) return n;
+    for(i=first; i<n; i++) if(sq[i][0] == y && sq[i][1] == x) return n;
+    sq[n][0] = y; sq[n][1] = x;
+    return n + 1;
+}
+
+static int
+KeySquares (int fromX, int fromY, int toX, int toY, int sq[][2])
+{   // [HGM] hash: list the board squares ApplyMove could alter; returns their number
+    int n = 0, first, x, y;
+    for(x=BOARD_LEFT; x<BOARD_RGHT; x++) { // whole ranks of from- and to-square, for castling and swaps
+	sq[n][0] = toY; sq[n++][1] = x;
+	if(fromY != toY && fromY != DROP_RANK) sq[n][0] = fromY, sq[n++][1] = x;
+    }
+    first = n;
+    for(y=toY-2; y<=toY+2; y++) for(x=toX-1; x<=toX+1; x++) // e.p. victims and atomic explosion
+	if(y != toY && y != fromY && ((y - toY < 2 && toY - y < 2) || x == toX)) n = AddKeySquare(sq, n, first, y, x);
+    if(killY != toY && killY != fromY) n = AddKeySquare(sq, n, first, killY, killX);
+    if(kill2Y != toY && kill2Y != fromY) n = AddKeySquare(sq, n, first, kill2Y, kill2X);
+    return n;
+}
+
+void
+ApplyMove (int fromX, int fromY, int toX, int toY, int promoChar, Board board)
+{   // [HGM] hash: apply the move, and update the placement key cached in the board from the squares that changed
+    ChessSquare old[2*BOARD_FILES+16], p;
+    int sq[2*BOARD_FILES+16][2], i, n;
+    u64 key, oldKey;
+
+    if(board[KEY_STATE] != (ChessSquare) KEY_SET) { // no valid key to maintain
+	ApplyMoveToBoard(fromX, fromY, toX, toY, promoChar, board);
+	return;
+    }
+    key = oldKey = PlacementKey(board);
+    n = KeySquares(fromX, fromY, toX, toY, sq);
+    for(i=0; i<n; i++) old[i] = board[sq[i][0]][sq[i][1]];
+    ApplyMoveToBoard(fromX, fromY, toX, toY, promoChar, board);
+    for(i=0; i<n; i++) if((p = board[sq[i][0]][sq[i][1]]) != old[i]) {
+	if(old[i] != EmptySquare) key ^= PieceKey(old[i], sq[i][0], sq[i][1]);
+	if(p != EmptySquare) key ^= PieceKey(p, sq[i][0], sq[i][1]);
+    }
+    SetPlacementKey(board, key);
+    if(listsUsed) MovePieces(oldKey, key, old, board, sq, n); // [HGM] pieces: carry the piece list along
+}
+
+// [HGM] perft: count the leaf nodes of the game tree to a given depth, to check and time the move generator.
+//       Moves are enumerated as the GUI would accept them: the moves of GenLegal, with every promotion choice
+//       that LegalityTest allows, plus all drops that LegalityTest allows in variants with holdings.
+
+#define PERFT_MOVES 1024
+
+typedef struct {
+    int rf, ff, rt, ft, promoChar;
+    ChessMove kind;
+} PerftMove;
+
+typedef struct {
+    int n;
+    PerftMove move[PERFT_MOVES];
+} PerftList;
+
+static int perftPlus;        // variant has Shogi-style promotions
+static char perftPromo[64];  // piece letters to try on promotion
+
+static void
+PerftCallback (Board board, int flags, ChessMove kind, int rf, int ff, int rt, int ft, VOIDSTAR closure)
+{
+    PerftList *l = (PerftList *) closure;
+    PerftMove *m = l->move + l->n;
+    if(kind == FirstLeg || l->n >= PERFT_MOVES) return; // first legs of multi-leg moves are not moves
+    m->rf = rf; m->ff = ff; m->rt = rt; m->ft = ft; m->kind = kind; m->promoChar = NULLCHAR;
+    l->n++;
+}
+
+static void
+PerftExpand (Board board, int flags, PerftMove *m, PerftList *list)
+{   // add the move for every promotion choice that is legal and leads to a different position
+    char choices[70], *c = choices;
+    ChessSquare result[70], p;
+    int n = 0, i;
+    ChessMove kind;
+    Board child;
+
+    *c++ = NULLCHAR; *c++ = '+'; *c++ = '='; // first three tried anyway, to get the legal kind
+    if(m->kind == WhitePromotion || m->kind == BlackPromotion) strcpy(c, perftPromo); else *c = NULLCHAR;
+    for(c = choices; c == choices || *c; c++) {
+	kind = LegalityTest(board, flags, m->rf, m->ff, m->rt, m->ft, *c);
+	if(kind == IllegalMove || kind == ImpossibleMove) continue;
+	if(!*c && (kind == WhitePromotion || kind == BlackPromotion)) continue; // needs explicit choice
+	CopyBoard(child, board);
+	ApplyMove(m->ff, m->rf, m->ft, m->rt, *c, child);
+	p = child[m->rt][m->ft];
+	for(i=0; i<n; i++) if(result[i] == p) break;
+	if(i < n || list->n >= PERFT_MOVES) continue; // same as earlier choice
+	result[n++] = p;
+	list->move[list->n] = *m;
+	list->move[list->n].kind = kind;
+	list->move[list->n++].promoChar = *c;
+    }
+}
+
+static u64
+PerftNode (Board board, int ply, int depth)
+{
+    PerftList raw, list;
+    PerftMove *m;
+    LegalMoveList *legal;
+    Board child;
+    int flags = PosFlags(ply), captures = 0, i, r, f;
+    u64 nodes = 0;
+
+    raw.n = list.n = 0;
+    killX = killY = kill2X = kill2Y = -1;
+    if((legal = LegalMoves(board, flags))) // [HGM] batch: LegalityTest on the promotions then uses the same list
+	for(i=0; i<legal->n; i++) PerftCallback(board, flags, legal->move[i].kind, legal->move[i].rf, legal->move[i].ff,
+						legal->move[i].rt, legal->move[i].ft, (VOIDSTAR) &raw);
+    else GenLegal(board, flags, PerftCallback, (VOIDSTAR) &raw, EmptySquare);
+    if(flags & F_MANDATORY_CAPTURE) // [HGM] losers: when there are captures, other moves are illegal
+	for(i=0; i<raw.n; i++) captures |= (board[raw.move[i].rt][raw.move[i].ft] != EmptySquare ||
+		raw.move[i].kind == WhiteCapturesEnPassant || raw.move[i].kind == BlackCapturesEnPassant);
+    for(i=0; i<raw.n; i++) {
+	m = raw.move + i;
+	if(captures && board[m->rt][m->ft] == EmptySquare &&
+	   m->kind != WhiteCapturesEnPassant && m->kind != BlackCapturesEnPassant) continue;
+	if(perftPlus || m->kind == WhitePromotion || m->kind == BlackPromotion) PerftExpand(board, flags, m, &list);
+	else if(list.n < PERFT_MOVES) list.move[list.n++] = *m;
+    }
+    if(gameInfo.holdingsWidth && !captures) { // drops
+	for(i=0; i<BOARD_HEIGHT; i++) {
+	    ChessSquare piece = (flags & F_WHITE_ON_MOVE ? board[i][BOARD_WIDTH-1] : board[BOARD_HEIGHT-1-i][0]);
+	    int count = (flags & F_WHITE_ON_MOVE ? board[i][BOARD_WIDTH-2] : board[BOARD_HEIGHT-1-i][1]);
+	    if(piece == EmptySquare || count <= 0) continue;
+	    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
+		ChessMove kind;
+		if(board[r][f] != EmptySquare || list.n >= PERFT_MOVES) continue;
+		kind = LegalityTest(board, flags, DROP_RANK, piece, r, f, NULLCHAR);
+		if(kind == IllegalMove || kind == ImpossibleMove) continue;
+		m = list.move + list.n++;
+		m->rf = DROP_RANK; m->ff = piece; m->rt = r; m->ft = f; m->kind = kind; m->promoChar = NULLCHAR;
+	    }
+	}
+    }
+    if(depth == 1) return list.n;
+    for(i=0; i<list.n; i++) {
+	m = list.move + i;
+	CopyBoard(child, board);
+	ApplyMove(m->ff, m->rf, m->ft, m->rt, m->promoChar, child);
+	nodes += PerftNode(child, ply + 1, depth - 1);
+    }
+    return nodes;
+}
+
+int
+Perft (int depth)
+{   // run perft from the position given by -variant and -fen, for all depths up to the given one
+    int blackPlaysFirst = FALSE, d, c;
+    ChessSquare p;
+    TimeMark start, now;
+    u64 nodes;
+    long ms;
+
+    appData.testLegality = TRUE;
+    gameInfo.variant = StringToVariant(appData.variant);
+    InitPosition(FALSE);
+    if(*appData.fen && !ParseFEN(boards[0], &blackPlaysFirst, appData.fen, FALSE)) {
+	fprintf(stderr, _("Bad FEN position: %s\n"), appData.fen);
+	return 1;
+    }
+    perftPlus = IS_SHOGI(gameInfo.variant);
+    for(p = WhitePawn, d = 0; p <= WhiteKing; p++) {
+	if((c = PieceToChar(p)) == '+') perftPlus = TRUE;
+	if(isalpha(c) && !strchr(perftPromo, ToLower(c))) perftPromo[d++] = ToLower(c);
+    }
+    for(d=1; d<=depth; d++) {
+	GetTimeMark(&start);
+	nodes = PerftNode(boards[0], blackPlaysFirst, d);
+	GetTimeMark(&now);
+	ms = SubtractTimeMarks(&now, &start);
+	printf("perft %d: %llu nodes, %ld ms, %.0f nodes/sec\n", d, (unsigned long long) nodes, ms,
+		ms ? 1000.*nodes/ms : 0.);
+	fflush(stdout);
+    }
+    return 0;
+}
+
 /* Updates forwardMostMove */
 void
 MakeMove (int fromX, int fromY, int toX, int toY, int promoChar)
@@ -12041,7 +12331,7 @@ Reset (int redraw, int init)
     }
     pieceDefs = FALSE; // [HGM] gen: reset engine-defined piece moves
     deadRanks = 0; // assume entire board is used
-    for(i=0; i<EmptySquare; i++) { FREE(pieceDesc[i]); pieceDesc[i] = NULL; }
+    for(i=0; i<EmptySquare; i++) { FREE(pieceDesc[i]); pieceDesc[i] = NULL; CompilePieceDesc(i); }
     CleanupTail(); // [HGM] vari: delete any stored variations
     CommentPopDown(); // [HGM] make sure no comments to the previous game keep hanging on
     pausing = pauseExamInvalid = FALSE;
@@ -12484,7 +12774,7 @@ LoadGameFromFile (char *filename, int n, char *title, int useList)
 	useList = FALSE;
     }
     if (useList && n == 0) {
-	int error = GameListBuild(f);
+	int error = GameListBuild(f, f == stdin ? NULL : filename);
 	if (error) {
 	    DisplayError(_("Cannot build game list"), error);
 	} else if (!ListEmpty(&gameList) &&
@@ -12636,8 +12926,8 @@ PositionMatches (Board b1, Board b2)
     switch(appData.searchMode) {
 	case 1: return CompareWithRights(b1, b2);
 	case 2:
-	    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
-		if(b2[r][f] != EmptySquare && b1[r][f] != b2[r][f]) return FALSE;
+	    { PieceList *pl = Pieces(b2); // the sought position; the same for all games
+	      for(r=0; r<pl->n; r++) if(b1[pl->r[r]][pl->f[r]] != pl->piece[r]) return FALSE;
 	    }
 	    return TRUE;
 	case 3:
@@ -12660,175 +12950,285 @@ PositionMatches (Board b1, Board b2)
 #define Q_BCASTL 2
 #define Q_WCASTL 1
 
-int pieceList[256], quickBoard[256];
-ChessSquare pieceType[256] = { EmptySquare };
+typedef struct { // [HGM] quick-scan state, separate for each thread that searches games
+    int pieceList[256], quickBoard[256];
+    ChessSquare pieceType[256];
+    int counts[EmptySquare], lastCounts[EmptySquare+1];
+    int turn;
+    u64 key; // Zobrist key of the pieces, kept up to date for exact-position search
+} ScanState;
+
+THREAD_LOCAL ScanState packState; // used when packing the games
 Board soughtBoard, reverseBoard, flipBoard, rotateBoard;
-int counts[EmptySquare], minSought[EmptySquare], minReverse[EmptySquare], maxSought[EmptySquare], maxReverse[EmptySquare];
-int soughtTotal, turn;
-Boolean epOK, flipSearch;
+int minSought[EmptySquare], minReverse[EmptySquare], maxSought[EmptySquare], maxReverse[EmptySquare];
+int soughtTotal;
+u64 soughtKey, reverseKey, flipKey, rotateKey;
+Boolean epOK, flipSearch, indexSearch, keyScan;
 
 typedef struct {
     unsigned char piece, to;
 } Move;
 
-#define DSIZE (250000)
+// [HGM] the packed games are stored in an arena of fixed-size chunks, allocated as they are needed.
+// A game never straddles two chunks, so QuickScan can step through it with a plain pointer.
+#define CHUNK_BITS 18
+#define CHUNK_SIZE (1<<CHUNK_BITS) // moves per chunk (512KB)
+#define MAX_CHUNKS (1<<13)         // indexes must fit in an int
+#define MAX_GAME   4000            // games do not start closer than this to the end of a chunk
 
-Move initialSpace[DSIZE+1000]; // gamble on that game will not be more than 500 moves
-Move *moveDatabase = initialSpace;
-unsigned int movePtr, dataSize = DSIZE;
+Move initialSpace[CHUNK_SIZE];
+Move *moveChunk[MAX_CHUNKS] = { initialSpace };
+static unsigned int usedChunks;      // chunks handed out to the threads that pack games
+static THREAD_LOCAL unsigned int movePtr;
+static THREAD_LOCAL Boolean packing; // this thread has a chunk to pack into
+
+// [HGM] material timeline: behind the terminator of each packed game the changes of material are stored,
+// as entries (ply 2 bytes, n, n x (piece type, delta)), ending with an entry for ply N+1 without changes.
+// The cell before the first move holds its offset from that move (0 if there is none). Material searches
+// can then rule out a game by only looking at the few positions where the material changes.
+#define MAT_BUF 1024
+
+static THREAD_LOCAL unsigned char matBuf[MAT_BUF]; // timeline of the game being packed
+static THREAD_LOCAL int matLen, matEntry, packPly, gameStart;
+
+static Move *
+MoveCell (unsigned int n)
+{
+    return moveChunk[n >> CHUNK_BITS] + (n & (CHUNK_SIZE-1));
+}
 
 int
-MakePieceList (Board board, int *counts)
+MakePieceList (ScanState *s, Board board, int *counts)
 {
     int r, f, n=Q_PROMO, total=0;
+    s->pieceType[0] = EmptySquare; // empty squares refer to this
+    s->key = 0;
     for(r=0;r<EmptySquare;r++) counts[r] = 0; // piece-type counts
     for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
 	int sq = f + (r<<4);
-        if(board[r][f] == EmptySquare) quickBoard[sq] = 0; else {
-	    quickBoard[sq] = ++n;
-	    pieceList[n] = sq;
-	    pieceType[n] = board[r][f];
+        if(board[r][f] == EmptySquare) s->quickBoard[sq] = 0; else {
+	    s->quickBoard[sq] = ++n;
+	    s->pieceList[n] = sq;
+	    s->pieceType[n] = board[r][f];
 	    counts[board[r][f]]++;
-	    if(board[r][f] == WhiteKing) pieceList[1] = n; else
-	    if(board[r][f] == BlackKing) pieceList[2] = n; // remember which are Kings, for castling
+	    if(board[r][f] == WhiteKing) s->pieceList[1] = n; else
+	    if(board[r][f] == BlackKing) s->pieceList[2] = n; // remember which are Kings, for castling
+	    if(keyScan && board[r][f] != DarkSquare) s->key ^= PieceKey(board[r][f], r, f);
 	    total++;
 	}
     }
-    epOK = gameInfo.variant != VariantXiangqi && gameInfo.variant != VariantBerolina;
     return total;
 }
 
-void
+static void
+MaterialChange (int type, int delta)
+{   // add a change of material at the current ply to the timeline
+    if(matLen < 0) return; // timeline overflowed
+    if(matEntry < 0 || (matBuf[matEntry] | matBuf[matEntry+1] << 8) != packPly) { // start new entry
+	if(matLen + 3 > MAT_BUF - 3) { matLen = -1; return; } // keep room for final entry
+	matEntry = matLen;
+	matBuf[matLen++] = packPly & 255; matBuf[matLen++] = packPly >> 8; matBuf[matLen++] = 0;
+    }
+    if(matLen + 2 > MAT_BUF - 3) { matLen = -1; return; }
+    matBuf[matLen++] = type; matBuf[matLen++] = delta;
+    matBuf[matEntry+2]++;
+}
+
+int
 PackMove (int fromX, int fromY, int toX, int toY, ChessSquare promoPiece)
 {
+    ScanState *s = &packState;
     int sq = fromX + (fromY<<4);
-    int piece = quickBoard[sq], rook;
-    quickBoard[sq] = 0;
-    moveDatabase[movePtr].to = pieceList[piece] = sq = toX + (toY<<4);
-    if(piece == pieceList[1] && fromY == toY) {
-      if((toX > fromX+1 || toX < fromX-1) && fromX != BOARD_LEFT && fromX != BOARD_RGHT-1) {
+    int piece = s->quickBoard[sq], rook;
+    if((movePtr & (CHUNK_SIZE-1)) >= CHUNK_SIZE - 4) return FALSE; // game too long for its chunk
+    if(++packPly >= 0xFFFF) matLen = -1; // too long for timeline
+    s->quickBoard[sq] = 0;
+    MoveCell(movePtr)->to = s->pieceList[piece] = sq = toX + (toY<<4);
+    if(piece == s->pieceList[1] && fromY == toY) {
+      if((toX > fromX+1 || toX < fromX-1) && fromX != BOARD_LEFT && fromX != BOARD_RGHT-1
+					   && !((rook = s->quickBoard[sq]) && s->pieceType[rook] == WhiteRook)) {
 	int from = toX>fromX ? BOARD_RGHT-1 : BOARD_LEFT;
-	moveDatabase[movePtr++].piece = Q_WCASTL;
-	quickBoard[sq] = piece;
-	piece = quickBoard[from]; quickBoard[from] = 0;
-	moveDatabase[movePtr].to = pieceList[piece] = sq = toX>fromX ? sq-1 : sq+1;
-      } else if((rook = quickBoard[sq]) && pieceType[rook] == WhiteRook) { // FRC castling
-	quickBoard[sq] = 0; // remove Rook
-	moveDatabase[movePtr].to = sq = (toX>fromX ? BOARD_RGHT-2 : BOARD_LEFT+2); // King to-square
-	moveDatabase[movePtr++].piece = Q_WCASTL;
-	quickBoard[sq] = pieceList[1]; // put King
+	MoveCell(movePtr++)->piece = Q_WCASTL;
+	s->quickBoard[sq] = piece;
+	piece = s->quickBoard[from]; s->quickBoard[from] = 0;
+	MoveCell(movePtr)->to = s->pieceList[piece] = sq = toX>fromX ? sq-1 : sq+1;
+      } else if((rook = s->quickBoard[sq]) && s->pieceType[rook] == WhiteRook) { // FRC castling
+	s->quickBoard[sq] = 0; // remove Rook
+	MoveCell(movePtr)->to = sq = (toX>fromX ? BOARD_RGHT-2 : BOARD_LEFT+2); // King to-square
+	MoveCell(movePtr++)->piece = Q_WCASTL;
+	s->quickBoard[sq] = s->pieceList[1]; // put King
 	piece = rook;
-	moveDatabase[movePtr].to = pieceList[rook] = sq = toX>fromX ? sq-1 : sq+1;
+	MoveCell(movePtr)->to = s->pieceList[rook] = sq = toX>fromX ? sq-1 : sq+1;
       }
     } else
-    if(piece == pieceList[2] && fromY == toY) {
-      if((toX > fromX+1 || toX < fromX-1) && fromX != BOARD_LEFT && fromX != BOARD_RGHT-1) {
+    if(piece == s->pieceList[2] && fromY == toY) {
+      if((toX > fromX+1 || toX < fromX-1) && fromX != BOARD_LEFT && fromX != BOARD_RGHT-1
+					   && !((rook = s->quickBoard[sq]) && s->pieceType[rook] == BlackRook)) {
 	int from = (toX>fromX ? BOARD_RGHT-1 : BOARD_LEFT) + (BOARD_HEIGHT-1 <<4);
-	moveDatabase[movePtr++].piece = Q_BCASTL;
-	quickBoard[sq] = piece;
-	piece = quickBoard[from]; quickBoard[from] = 0;
-	moveDatabase[movePtr].to = pieceList[piece] = sq = toX>fromX ? sq-1 : sq+1;
-      } else if((rook = quickBoard[sq]) && pieceType[rook] == BlackRook) { // FRC castling
-	quickBoard[sq] = 0; // remove Rook
-	moveDatabase[movePtr].to = sq = (toX>fromX ? BOARD_RGHT-2 : BOARD_LEFT+2);
-	moveDatabase[movePtr++].piece = Q_BCASTL;
-	quickBoard[sq] = pieceList[2]; // put King
+	MoveCell(movePtr++)->piece = Q_BCASTL;
+	s->quickBoard[sq] = piece;
+	piece = s->quickBoard[from]; s->quickBoard[from] = 0;
+	MoveCell(movePtr)->to = s->pieceList[piece] = sq = toX>fromX ? sq-1 : sq+1;
+      } else if((rook = s->quickBoard[sq]) && s->pieceType[rook] == BlackRook) { // FRC castling
+	s->quickBoard[sq] = 0; // remove Rook
+	MoveCell(movePtr)->to = sq = (toX>fromX ? BOARD_RGHT-2 : BOARD_LEFT+2) + (toY<<4);
+	MoveCell(movePtr++)->piece = Q_BCASTL;
+	s->quickBoard[sq] = s->pieceList[2]; // put King
 	piece = rook;
-	moveDatabase[movePtr].to = pieceList[rook] = sq = toX>fromX ? sq-1 : sq+1;
+	MoveCell(movePtr)->to = s->pieceList[rook] = sq = toX>fromX ? sq-1 : sq+1;
       }
     } else
-    if(epOK && (pieceType[piece] == WhitePawn || pieceType[piece] == BlackPawn) && fromX != toX && quickBoard[sq] == 0) {
-	quickBoard[(fromY<<4)+toX] = 0;
-	moveDatabase[movePtr].piece = Q_EP;
-	moveDatabase[movePtr++].to = (fromY<<4)+toX;
-	moveDatabase[movePtr].to = sq;
+    if(epOK && (s->pieceType[piece] == WhitePawn || s->pieceType[piece] == BlackPawn) && fromX != toX && s->quickBoard[sq] == 0) {
+	MaterialChange(s->pieceType[s->quickBoard[(fromY<<4)+toX]], -1);
+	s->quickBoard[(fromY<<4)+toX] = 0;
+	MoveCell(movePtr)->piece = Q_EP;
+	MoveCell(movePtr++)->to = (fromY<<4)+toX;
+	MoveCell(movePtr)->to = sq;
     } else
-    if(promoPiece != pieceType[piece]) {
-	moveDatabase[movePtr++].piece = Q_PROMO;
-	moveDatabase[movePtr].to = pieceType[piece] = (int) promoPiece;
-    }
-    moveDatabase[movePtr].piece = piece;
-    quickBoard[sq] = piece;
+    if(promoPiece != s->pieceType[piece]) {
+	MaterialChange(s->pieceType[piece], -1); MaterialChange(promoPiece, 1);
+	MoveCell(movePtr++)->piece = Q_PROMO;
+	MoveCell(movePtr)->to = s->pieceType[piece] = (int) promoPiece;
+    }
+    if(s->quickBoard[sq]) MaterialChange(s->pieceType[s->quickBoard[sq]], -1); // capture
+    MoveCell(movePtr)->piece = piece;
+    s->quickBoard[sq] = piece;
     movePtr++;
+    return TRUE;
+}
+
+static int
+NewChunk ()
+{   // hand out the next unused chunk of the arena, allocating it if needed; -1 if the arena is full
+    int chunk;
+#if USE_THREADS
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&lock);
+#endif
+    chunk = usedChunks;
+    if(chunk >= MAX_CHUNKS || (!moveChunk[chunk] && !(moveChunk[chunk] = (Move *) malloc(CHUNK_SIZE * sizeof(Move))))) {
+	if(appData.debugMode) fprintf(debugFP, "move cache full at %d MB\n", (int) (chunk*sizeof(Move) << CHUNK_BITS >> 20));
+	chunk = -1;
+    } else usedChunks++;
+#if USE_THREADS
+    pthread_mutex_unlock(&lock);
+#endif
+    return chunk;
+}
+
+void
+PackReset ()
+{   // start packing a new game list; the games of the old one are discarded
+    usedChunks = 0;
+    packing = FALSE;
+    epOK = gameInfo.variant != VariantXiangqi && gameInfo.variant != VariantBerolina;
+}
+
+void
+PackResume (int moves)
+{   // continue packing in the place of a game that will be packed again, leaving earlier games intact
+    packing = (moves > 0);
+    movePtr = moves - 1; // its header cell, which PackGame will reuse
+    gameStart = 0;
+    epOK = gameInfo.variant != VariantXiangqi && gameInfo.variant != VariantBerolina;
+}
+
+static void
+FinishGame ()
+{   // terminate the game being packed, and store its material timeline behind it
+    int cells, offset;
+    Move *header;
+    if(!packing || !gameStart) return;
+    MoveCell(movePtr++)->piece = 0;
+    if(matLen >= 0) {
+	matBuf[matLen++] = (packPly+1) & 255; matBuf[matLen++] = (packPly+1) >> 8; matBuf[matLen++] = 0; // end of last segment
+	cells = (matLen + 1)/2; offset = movePtr - gameStart;
+	if(offset < 0x10000 && (movePtr & (CHUNK_SIZE-1)) + cells < CHUNK_SIZE) {
+	    memcpy(MoveCell(movePtr), matBuf, matLen);
+	    header = MoveCell(gameStart - 1);
+	    header->piece = offset & 255; header->to = offset >> 8;
+	    movePtr += cells;
+	}
+    }
+    gameStart = 0;
 }
 
 int
 PackGame (Board board)
 {
-    Move *newSpace = NULL;
-    moveDatabase[movePtr].piece = 0; // terminate previous game
-    if(movePtr > dataSize) {
-	if(appData.debugMode) fprintf(debugFP, "move-cache overflow, enlarge to %d MB\n", dataSize/128);
-	dataSize *= 8; // increase size by factor 8 (512KB -> 4MB -> 32MB -> 256MB -> 2GB)
-	if(dataSize) newSpace = (Move*) calloc(dataSize + 1000, sizeof(Move));
-	if(newSpace) {
-	    int i;
-	    Move *p = moveDatabase, *q = newSpace;
-	    for(i=0; i<movePtr; i++) *q++ = *p++;    // copy to newly allocated space
-	    if(dataSize > 8*DSIZE) free(moveDatabase); // and free old space (if it was allocated)
-	    moveDatabase = newSpace;
-	} else { // calloc failed, we must be out of memory. Too bad...
-	    dataSize = 0; // prevent calloc events for all subsequent games
-	    return 0;     // and signal this one isn't cached
-	}
-    }
-    movePtr++;
-    MakePieceList(board, counts);
+    FinishGame(); // of previous game
+    if(!packing || (movePtr & (CHUNK_SIZE-1)) >= CHUNK_SIZE - MAX_GAME) { // continue in a fresh chunk
+	int chunk = NewChunk();
+	packing = (chunk >= 0);
+	if(!packing) return 0; // game is not cached, so searching it will have to read it from the file
+	movePtr = chunk << CHUNK_BITS; // first cell of a chunk is never a game, so 0 can mean 'not cached'
+    }
+    MoveCell(movePtr)->piece = MoveCell(movePtr)->to = 0; // header: no timeline (yet)
+    gameStart = ++movePtr;
+    packPly = matLen = 0; matEntry = -1;
+    MakePieceList(&packState, board, packState.counts);
     return movePtr;
 }
 
+void
+PackEnd ()
+{   // terminate the last game this thread packed
+    FinishGame();
+    packing = FALSE;
+}
+
 int
-QuickCompare (Board board, int *minCounts, int *maxCounts)
+QuickCompare (ScanState *s, Board board, u64 key, int *minCounts, int *maxCounts)
 {   // compare according to search mode
     int r, f;
     switch(appData.searchMode)
     {
       case 1: // exact position match
-	if(!(turn & board[EP_STATUS-1])) return FALSE; // wrong side to move
+	if(!(s->turn & board[EP_STATUS-1])) return FALSE; // wrong side to move
+	if(keyScan && s->key != key) return FALSE; // only compare squares on a key hit
 	for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
-	    if(board[r][f] != pieceType[quickBoard[(r<<4)+f]]) return FALSE;
+	    if(board[r][f] != s->pieceType[s->quickBoard[(r<<4)+f]]) return FALSE;
 	}
 	break;
       case 2: // can have extra material on empty squares
 	for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
 	    if(board[r][f] == EmptySquare) continue;
-	    if(board[r][f] != pieceType[quickBoard[(r<<4)+f]]) return FALSE;
+	    if(board[r][f] != s->pieceType[s->quickBoard[(r<<4)+f]]) return FALSE;
 	}
 	break;
       case 3: // material with exact Pawn structure
 	for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
 	    if(board[r][f] != WhitePawn && board[r][f] != BlackPawn) continue;
-	    if(board[r][f] != pieceType[quickBoard[(r<<4)+f]]) return FALSE;
+	    if(board[r][f] != s->pieceType[s->quickBoard[(r<<4)+f]]) return FALSE;
 	} // fall through to material comparison
       case 4: // exact material
-	for(r=0; r<EmptySquare; r++) if(counts[r] != maxCounts[r]) return FALSE;
+	for(r=0; r<EmptySquare; r++) if(s->counts[r] != maxCounts[r]) return FALSE;
 	break;
       case 6: // material range with given imbalance
-	for(r=0; r<BlackPawn; r++) if(counts[r] - minCounts[r] != counts[r+BlackPawn] - minCounts[r+BlackPawn]) return FALSE;
+	for(r=0; r<BlackPawn; r++) if(s->counts[r] - minCounts[r] != s->counts[r+BlackPawn] - minCounts[r+BlackPawn]) return FALSE;
 	// fall through to range comparison
       case 5: // material range
-	for(r=0; r<EmptySquare; r++) if(counts[r] < minCounts[r] || counts[r] > maxCounts[r]) return FALSE;
+	for(r=0; r<EmptySquare; r++) if(s->counts[r] < minCounts[r] || s->counts[r] > maxCounts[r]) return FALSE;
     }
     return TRUE;
 }
 
 int
-QuickScan (Board board, Move *move)
+QuickScan (ScanState *s, Board board, Move *move)
 {   // reconstruct game,and compare all positions in it
-    int cnt=0, stretch=0, found = -1, total = MakePieceList(board, counts);
+    int cnt=0, stretch=0, found = -1, total = MakePieceList(s, board, s->counts);
     do {
 	int piece = move->piece;
-	int to = move->to, from = pieceList[piece];
+	int to = move->to, from = s->pieceList[piece];
 	if(found < 0) { // if already found just scan to game end for final piece count
-	  if(QuickCompare(soughtBoard, minSought, maxSought) ||
-	   appData.ignoreColors && QuickCompare(reverseBoard, minReverse, maxReverse) ||
-	   flipSearch && (QuickCompare(flipBoard, minSought, maxSought) ||
-				appData.ignoreColors && QuickCompare(rotateBoard, minReverse, maxReverse))
+	  if(QuickCompare(s, soughtBoard, soughtKey, minSought, maxSought) ||
+	   appData.ignoreColors && QuickCompare(s, reverseBoard, reverseKey, minReverse, maxReverse) ||
+	   flipSearch && (QuickCompare(s, flipBoard, flipKey, minSought, maxSought) ||
+				appData.ignoreColors && QuickCompare(s, rotateBoard, rotateKey, minReverse, maxReverse))
 	    ) {
-	    static int lastCounts[EmptySquare+1];
 	    int i;
-	    if(stretch) for(i=0; i<EmptySquare; i++) if(lastCounts[i] != counts[i]) { stretch = 0; break; } // reset if material changes
-	    if(stretch++ == 0) for(i=0; i<EmptySquare; i++) lastCounts[i] = counts[i]; // remember actual material
+	    if(stretch) for(i=0; i<EmptySquare; i++) if(s->lastCounts[i] != s->counts[i]) { stretch = 0; break; } // reset if material changes
+	    if(stretch++ == 0) for(i=0; i<EmptySquare; i++) s->lastCounts[i] = s->counts[i]; // remember actual material
 	  } else stretch = 0;
 	  if(stretch && (appData.searchMode == 1 || stretch >= appData.stretch)) found = cnt + 1 - stretch;
 	  if(found >= 0 && !appData.minPieces) return found;
@@ -12837,45 +13237,109 @@ QuickScan (Board board, Move *move)
 	  if(!piece) return (appData.minPieces && (total < appData.minPieces || total > appData.maxPieces) ? -1 : found);
 	  if(piece == Q_PROMO) { // promotion, encoded as (Q_PROMO, to) + (piece, promoType)
 	    piece = (++move)->piece;
-	    from = pieceList[piece];
-	    counts[pieceType[piece]]--;
-	    pieceType[piece] = (ChessSquare) move->to;
-	    counts[move->to]++;
+	    from = s->pieceList[piece];
+	    s->counts[s->pieceType[piece]]--;
+	    if(keyScan) s->key ^= PieceKey(s->pieceType[piece], from>>4, from&15) ^ PieceKey((ChessSquare) move->to, from>>4, from&15);
+	    s->pieceType[piece] = (ChessSquare) move->to;
+	    s->counts[move->to]++;
 	  } else if(piece == Q_EP) { // e.p. capture, encoded as (Q_EP, ep-sqr) + (piece, to)
-	    counts[pieceType[quickBoard[to]]]--;
-	    quickBoard[to] = 0; total--;
+	    s->counts[s->pieceType[s->quickBoard[to]]]--;
+	    if(keyScan) s->key ^= PieceKey(s->pieceType[s->quickBoard[to]], to>>4, to&15);
+	    s->quickBoard[to] = 0; total--;
 	    move++;
 	    continue;
 	  } else if(piece <= Q_BCASTL) { // castling, encoded as (Q_XCASTL, king-to) + (rook, rook-to)
-	    piece = pieceList[piece]; // first two elements of pieceList contain King numbers
-	    from  = pieceList[piece]; // so this must be King
-	    quickBoard[from] = 0;
-	    pieceList[piece] = to;
-	    from = pieceList[(++move)->piece]; // for FRC this has to be done here
-	    quickBoard[from] = 0; // rook
-	    quickBoard[to] = piece;
+	    piece = s->pieceList[piece]; // first two elements of pieceList contain King numbers
+	    from  = s->pieceList[piece]; // so this must be King
+	    s->quickBoard[from] = 0;
+	    s->pieceList[piece] = to;
+	    if(keyScan) s->key ^= PieceKey(s->pieceType[piece], from>>4, from&15) ^ PieceKey(s->pieceType[piece], to>>4, to&15);
+	    from = s->pieceList[(++move)->piece]; // for FRC this has to be done here
+	    s->quickBoard[from] = 0; // rook
+	    s->quickBoard[to] = piece;
 	    to = move->to; piece = move->piece;
 	    goto aftercastle;
 	  }
 	}
-	if(appData.searchMode > 2) counts[pieceType[quickBoard[to]]]--; // account capture
-	if((total -= (quickBoard[to] != 0)) < soughtTotal && found < 0) return -1; // piece count dropped below what we search for
-	quickBoard[from] = 0;
+	if(appData.searchMode > 2) s->counts[s->pieceType[s->quickBoard[to]]]--; // account capture
+	if((total -= (s->quickBoard[to] != 0)) < soughtTotal && found < 0) return -1; // piece count dropped below what we search for
+	if(keyScan && s->quickBoard[to]) s->key ^= PieceKey(s->pieceType[s->quickBoard[to]], to>>4, to&15); // capture
+	s->quickBoard[from] = 0;
       aftercastle:
-	quickBoard[to] = piece;
-	pieceList[piece] = to;
-	cnt++; turn ^= 3;
+	if(keyScan) s->key ^= PieceKey(s->pieceType[piece], from>>4, from&15) ^ PieceKey(s->pieceType[piece], to>>4, to&15);
+	s->quickBoard[to] = piece;
+	s->pieceList[piece] = to;
+	cnt++; s->turn ^= 3;
 	move++;
     } while(1);
 }
 
+static int
+MaterialRuledOut (ScanState *s, Board board, int moves)
+{   // material searches: use the timeline of a packed game to see if the material can occur in it for long enough
+    Move *header = MoveCell(moves - 1);
+    unsigned char *p;
+    int offset = header->piece | header->to << 8, ply = 0, next, n, stretch = (appData.stretch > 1 ? appData.stretch : 1);
+    if(!offset) return FALSE; // no timeline, so game must be scanned
+    p = (unsigned char *) MoveCell(moves + offset);
+    MakePieceList(s, board, s->counts);
+    while(1) { // material is constant from ply to next
+	next = p[0] | p[1] << 8;
+	if(next - ply >= stretch && (QuickCompare(s, soughtBoard, soughtKey, minSought, maxSought) ||
+	   (appData.ignoreColors && QuickCompare(s, reverseBoard, reverseKey, minReverse, maxReverse)))) return FALSE;
+	if(!(n = p[2])) return TRUE; // end of game
+	for(p += 3; n > 0; n--, p += 2) s->counts[p[0]] += (signed char) p[1];
+	ply = next;
+    }
+}
+
+int
+UnpackGame (ListGame *lg, int max, signed char (*moves)[5])
+{   // [HGM] book: decode the first max moves of a packed game to from- and to-coordinates, plus promotion character.
+    // Return their number, or -1 if the game has to be parsed from the file (not packed, or not from the start position).
+    static THREAD_LOCAL ScanState scratch; // only pieceList and pieceType are used
+    ScanState *s = &scratch;
+    Move *move;
+    int n = 0, piece, from, to, dest, promo, castle, frc = PosFlags(0) & F_FRC_TYPE_CASTLING;
+    if(!lg->moves || lg->gameInfo.fen) return -1;
+    MakePieceList(s, initialPosition, s->counts);
+    for(move = MoveCell(lg->moves); n < max && (piece = move->piece); move++) {
+	to = dest = move->to; promo = NULLCHAR; castle = FALSE;
+	if(piece == Q_EP) continue; // the Pawn move in the next cell implies the e.p. capture
+	if(piece == Q_PROMO) { // (Q_PROMO, to) + (piece, promoType)
+	    piece = (++move)->piece;
+	    s->pieceType[piece] = (ChessSquare) move->to;
+	    promo = ToLower(PieceToChar(s->pieceType[piece]));
+	    if(promo < 'a' || promo > 'z') return -1; // not expressible as promotion character
+	} else if(piece <= Q_BCASTL) { // (Q_XCASTL, King-to) + (Rook, Rook-to): report the King move
+	    piece = s->pieceList[piece];
+	    if(frc) dest = s->pieceList[move[1].piece]; // as moveList has it: King captures own Rook
+	    s->pieceList[move[1].piece] = move[1].to;
+	    castle = TRUE;
+	}
+	from = s->pieceList[piece];
+	s->pieceList[piece] = to;
+	to = dest;
+	moves[n][0] = from & 15; moves[n][1] = from >> 4;
+	moves[n][2] = to & 15;   moves[n][3] = to >> 4;
+	moves[n++][4] = promo;
+	move += castle;
+    }
+    return n;
+}
+
 void
 InitSearch ()
 {
     int r, f;
-    flipSearch = FALSE;
+    static int initDone=FALSE;
+    if(!initDone) { // before the search threads use them
+	for(r = WhitePawn; r<EmptySquare; r++) keys[r] = random()>>8 ^ random()<<6 ^random()<<20;
+	initDone = TRUE;
+    }
+    flipSearch = keyScan = FALSE;
     CopyBoard(soughtBoard, boards[currentMove]);
-    soughtTotal = MakePieceList(soughtBoard, maxSought);
+    soughtTotal = MakePieceList(&packState, soughtBoard, maxSought);
     soughtBoard[EP_STATUS-1] = (currentMove & 1) + 1;
     if(currentMove == 0 && gameMode == EditPosition) soughtBoard[EP_STATUS-1] = blackPlaysFirst + 1; // (!)
     CopyBoard(reverseBoard, boards[currentMove]);
@@ -12903,41 +13367,59 @@ InitSearch ()
     for(r=0; r<BlackPawn; r++) maxReverse[r] = maxSought[r+BlackPawn], maxReverse[r+BlackPawn] = maxSought[r];
     if(appData.searchMode >= 5) {
 	for(r=BOARD_HEIGHT/2; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) soughtBoard[r][f] = EmptySquare;
-	MakePieceList(soughtBoard, minSought);
+	MakePieceList(&packState, soughtBoard, minSought);
 	for(r=0; r<BlackPawn; r++) minReverse[r] = minSought[r+BlackPawn], minReverse[r+BlackPawn] = minSought[r];
     }
     if(gameInfo.variant == VariantCrazyhouse || gameInfo.variant == VariantShogi || gameInfo.variant == VariantBughouse)
 	soughtTotal = 0; // in drop games nr of pieces does not fall monotonously
+    // [HGM] pieces: the copies were edited, so their cached keys are stale. Calculate the keys of all boards
+    // PositionMatches compares with here, so that Pieces() only reads them while the games are searched.
+    soughtBoard[KEY_STATE] = reverseBoard[KEY_STATE] = flipBoard[KEY_STATE] = rotateBoard[KEY_STATE] = EmptySquare;
+    if(gameMode == EditPosition) boards[currentMove][KEY_STATE] = EmptySquare; // could be edited behind our back
+    PlacementKey(soughtBoard); PlacementKey(reverseBoard); PlacementKey(flipBoard); PlacementKey(rotateBoard);
+    PlacementKey(boards[currentMove]);
+    // in exact search QuickScan keeps a hash key, and only compares the board when that matches (not with drops)
+    if(appData.searchMode == 1 && !gameInfo.holdingsWidth) {
+	soughtKey = PositionKey(soughtBoard, FALSE);
+	reverseKey = PositionKey(reverseBoard, FALSE);
+	if(flipSearch) flipKey = PositionKey(flipBoard, FALSE), rotateKey = PositionKey(rotateBoard, FALSE);
+	keyScan = TRUE;
+    }
+    indexSearch = FALSE;
+    if(appData.searchMode == 1 && appData.positionIndex) { // exact search: look up candidate games in index
+	u64 keys[4];
+	int n = 0;
+	keys[n++] = PositionKey(soughtBoard, soughtBoard[EP_STATUS-1] == 1);
+	if(appData.ignoreColors) keys[n++] = PositionKey(reverseBoard, reverseBoard[EP_STATUS-1] == 1);
+	if(flipSearch) {
+	    keys[n++] = PositionKey(flipBoard, soughtBoard[EP_STATUS-1] == 1);
+	    if(appData.ignoreColors) keys[n++] = PositionKey(rotateBoard, reverseBoard[EP_STATUS-1] == 1);
+	}
+	indexSearch = PositionIndexSearch(keys, n);
+    }
 }
 
 GameInfo dummyInfo;
 static int creatingBook;
 
-int
-GameContainsPosition (FILE *f, ListGame *lg)
-{
-    int next, btm=0, plyNr=0, scratch=forwardMostMove+2&~1;
+static int
+GameExcluded (ListGame *lg)
+{   // weed out games based on numerical tag comparison
+    if(lg->gameInfo.variant != gameInfo.variant) return TRUE; // wrong variant
+    if(appData.eloThreshold1 && (lg->gameInfo.whiteRating < appData.eloThreshold1 && lg->gameInfo.blackRating < appData.eloThreshold1)) return TRUE;
+    if(appData.eloThreshold2 && (lg->gameInfo.whiteRating < appData.eloThreshold2 || lg->gameInfo.blackRating < appData.eloThreshold2)) return TRUE;
+    if(appData.dateThreshold && (!lg->gameInfo.date || atoi(lg->gameInfo.date) < appData.dateThreshold)) return TRUE;
+    if(indexSearch && !PositionIndexHit(lg->number)) return TRUE; // position index says it is not there
+    return FALSE;
+}
+
+static int
+GameReplay (FILE *f, ListGame *lg, int scratch, int plyNr)
+{   // replay the game from the file, starting from the position in boards[scratch], to find the sought position
+    int next;
     int fromX, fromY, toX, toY;
     char promoChar;
-    static int initDone=FALSE;
 
-    // weed out games based on numerical tag comparison
-    if(lg->gameInfo.variant != gameInfo.variant) return -1; // wrong variant
-    if(appData.eloThreshold1 && (lg->gameInfo.whiteRating < appData.eloThreshold1 && lg->gameInfo.blackRating < appData.eloThreshold1)) return -1;
-    if(appData.eloThreshold2 && (lg->gameInfo.whiteRating < appData.eloThreshold2 || lg->gameInfo.blackRating < appData.eloThreshold2)) return -1;
-    if(appData.dateThreshold && (!lg->gameInfo.date || atoi(lg->gameInfo.date) < appData.dateThreshold)) return -1;
-    if(!initDone) {
-	for(next = WhitePawn; next<EmptySquare; next++) keys[next] = random()>>8 ^ random()<<6 ^random()<<20;
-	initDone = TRUE;
-    }
-    if(lg->gameInfo.fen) ParseFEN(boards[scratch], &btm, lg->gameInfo.fen, FALSE);
-    else CopyBoard(boards[scratch], initialPosition); // default start position
-    if(lg->moves) {
-	turn = btm + 1;
-	if((next = QuickScan( boards[scratch], &moveDatabase[lg->moves] )) < 0) return -1; // quick scan rules out it is there
-	if(appData.searchMode >= 4) return next; // for material searches, trust QuickScan.
-    }
-    if(btm) plyNr++;
     if(PositionMatches(boards[scratch], boards[currentMove])) return plyNr;
     fseek(f, lg->offset, 0);
     yynewfile(f);
@@ -13016,6 +13498,170 @@ GameContainsPosition (FILE *f, ListGame *lg)
     }
 }
 
+int
+GameContainsPosition (FILE *f, ListGame *lg)
+{
+    int next, btm=0, scratch=forwardMostMove+2&~1;
+
+    if(GameExcluded(lg)) return -1;
+    if(lg->gameInfo.fen) ParseFEN(boards[scratch], &btm, lg->gameInfo.fen, FALSE);
+    else CopyBoard(boards[scratch], initialPosition); // default start position
+    if(lg->moves) {
+	packState.turn = btm + 1;
+	if(appData.searchMode >= 4 && MaterialRuledOut(&packState, boards[scratch], lg->moves)) return -1;
+	if((next = QuickScan( &packState, boards[scratch], MoveCell(lg->moves) )) < 0) return -1; // quick scan rules out it is there
+	if(appData.searchMode >= 4) return next; // for material searches, trust QuickScan.
+    }
+    return GameReplay(f, lg, scratch, btm);
+}
+
+/* [HGM] parallel search: the part of GameContainsPosition that only uses the packed game is done
+ * by several threads, each with its own ScanState. Games it cannot decide are finished afterwards:
+ * those that passed the quick scan by replaying them from the file, and those that start from a FEN
+ * or were not packed by GameContainsPosition.
+ */
+#define UNDECIDED (-2)
+#define REPLAY    (-3)
+#define CHUNK 256
+
+typedef struct {
+    ListGame **games;
+    int *result;
+    int nr, next, done, shown;
+#if USE_THREADS
+    pthread_mutex_t lock;
+#endif
+} SearchJob;
+
+static void
+QuickSearchGame (ScanState *s, ListGame *lg, int *result)
+{
+    Board board;
+    int found;
+    if(GameExcluded(lg)) { *result = -1; return; }
+    if(!lg->moves || lg->gameInfo.fen) { *result = UNDECIDED; return; }
+    CopyBoard(board, initialPosition);
+    if(appData.searchMode >= 4 && MaterialRuledOut(s, board, lg->moves)) { *result = -1; return; }
+    s->turn = 1;
+    found = QuickScan(s, board, MoveCell(lg->moves));
+    *result = (found < 0 || appData.searchMode >= 4 ? found : REPLAY);
+}
+
+static void
+SearchChunks (SearchJob *job, int report)
+{   // search chunks of games until none are left; the main thread reports the progress
+    ScanState *s = (ScanState *) malloc(sizeof(ScanState));
+    int i, first, done;
+    char buf[MSG_SIZ];
+    if(!s) return; // other threads will take our share
+    while(1) {
+#if USE_THREADS
+	pthread_mutex_lock(&job->lock);
+#endif
+	first = job->next; job->next += CHUNK;
+#if USE_THREADS
+	pthread_mutex_unlock(&job->lock);
+#endif
+	if(first >= job->nr) break;
+	for(i=first; i<first+CHUNK && i<job->nr; i++) QuickSearchGame(s, job->games[i], job->result + i);
+#if USE_THREADS
+	pthread_mutex_lock(&job->lock);
+#endif
+	done = (job->done += i - first);
+#if USE_THREADS
+	pthread_mutex_unlock(&job->lock);
+#endif
+	if(report && done - job->shown >= 2000) {
+	    job->shown = done;
+	    snprintf(buf, MSG_SIZ, _("Scanning through games (%d)"), done);
+	    DisplayTitle(buf); DoEvents();
+	}
+    }
+    free(s);
+}
+
+static void *
+SearchWorker (void *arg)
+{
+    SearchChunks((SearchJob *) arg, FALSE);
+    FreeLegalMoves();
+    return NULL;
+}
+
+static int
+FilterMatch (ListGame *lg, char *filter, int byTags)
+{   // does the game pass the tag filter, or does its list line contain the filter pattern?
+    char *line;
+    int match;
+    if(byTags) return TagFilterMatch(lg->number);
+    if(!filter || filter[0] == NULLCHAR) return TRUE;
+    line = GameListLine(lg->number, &lg->gameInfo);
+    match = SearchPattern(line, filter);
+    free(line);
+    return match;
+}
+
+int *
+SearchGames (FILE *f, int narrow, char *filter, int byTags)
+{   // return array with for every game of the list the ply where the sought position occurs, or -1.
+    // Only games that pass the filter are searched; others get -1 as well.
+    ListGame *lg;
+    SearchJob job;
+    int i, n = 0, nr = ((ListGame *) gameList.tailPred)->number, *result, threads = 1, first = -1, last = -1;
+    char buf[MSG_SIZ];
+
+    result = (int *) malloc((nr + 1) * sizeof(int));
+    job.games = (ListGame **) malloc((nr + 1) * sizeof(ListGame *));
+    if(!result || !job.games) { free(result); free(job.games); return NULL; }
+    for(lg = (ListGame *) gameList.head, i = 0; lg->node.succ; lg = (ListGame *) lg->node.succ, i++) {
+	result[i] = -1;
+	if(narrow && lg->position < 0) continue; // only consider already selected positions when narrowing
+	if(FilterMatch(lg, filter, byTags)) job.games[n++] = lg;
+    }
+    job.nr = n; job.next = job.done = job.shown = 0; job.result = (int *) malloc((n + 1) * sizeof(int));
+    if(!job.result) { free(result); free(job.games); return NULL; }
+#if USE_THREADS
+    {
+	pthread_t tid[64];
+# ifdef _SC_NPROCESSORS_ONLN
+	if(n > 4*CHUNK) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > 64) threads = 64;
+# endif
+	pthread_mutex_init(&job.lock, NULL);
+	for(i=1; i<threads; i++) if(pthread_create(&tid[i], NULL, SearchWorker, &job)) break;
+	threads = i;
+	SearchChunks(&job, TRUE); // main thread participates
+	for(i=1; i<threads; i++) pthread_join(tid[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+    }
+#else
+    SearchChunks(&job, TRUE);
+#endif
+    if(job.next < n) { free(result); free(job.games); free(job.result); return NULL; } // out of memory
+    for(i=0; i<n; i++) if(job.result[i] == REPLAY || job.result[i] == UNDECIDED) { if(first < 0) first = i; last = i; }
+    if(last > first) { // load the stretch of the file holding the games to replay in memory, to parse them from there
+	lg = (ListGame *) job.games[last]->node.succ;
+	fseek(f, job.games[first]->offset, SEEK_SET);
+	yymapfile(f, lg->node.succ ? lg->offset : -1);
+    }
+    for(i=0; i<n; i++) { // finish undecided games serially, as the parser cannot be shared
+	if(job.result[i] == REPLAY) { // quick scan done already
+	    int scratch = (forwardMostMove+2) & ~1;
+	    CopyBoard(boards[scratch], initialPosition);
+	    job.result[i] = GameReplay(f, job.games[i], scratch, 0);
+	} else
+	if(job.result[i] == UNDECIDED) job.result[i] = GameContainsPosition(f, job.games[i]);
+	result[job.games[i]->number - 1] = job.result[i];
+	if(i % 2000 == 0) {
+	    snprintf(buf, MSG_SIZ, _("Scanning through games (%d)"), job.games[i]->number);
+	    DisplayTitle(buf); DoEvents();
+	}
+    }
+    yyunmap();
+    free(job.games); free(job.result);
+    return result;
+}
+
 /* Load the nth game from open file f */
 int
 LoadGame (FILE *f, int gameNumber, char *title, int useList)
@@ -13213,7 +13859,7 @@ LoadGame (FILE *f, int gameNumber, char *title, int useList)
     if (appData.debugMode)
       fprintf(debugFP, "Parsed game start '%s' (%d)\n", yy_text, (int) cm);
 
-    for(i=0; i<EmptySquare; i++) { FREE(pieceDesc[i]); pieceDesc[i] = NULL; } // reset VariantMen
+    for(i=0; i<EmptySquare; i++) { FREE(pieceDesc[i]); pieceDesc[i] = NULL; CompilePieceDesc(i); } // reset VariantMen
 
     if (cm == XBoardGame) {
 	/* Skip any header junk before position diagram and/or move 1 */
@@ -15387,6 +16033,7 @@ EditPositionDone (Boolean fakeRights)
     int king = gameInfo.variant == VariantKnightmate ? WhiteUnicorn : WhiteKing;
 
     startedFromSetupPosition = TRUE;
+    boards[0][KEY_STATE] = EmptySquare; // [HGM] hash: edits did not update the key
     InitChessProgram(&first, FALSE);
     if(fakeRights) { // [HGM] suppress this if we just pasted a FEN.
       int r, f;
@@ -16405,6 +17052,13 @@ CreateBookEvent ()
     creatingBook = TRUE;
     secondTime = FALSE;
 
+    if(!mcMode) { // [HGM] book: build it directly from the packed games; MC mode needs them in its memory book
+	BuildBook(f);
+	creatingBook = FALSE;
+	DisplayTitle("");
+	return;
+    }
+
     /* Get list size */
     for (nItem = 1; nItem <= ((ListGame *) gameList.tailPred)->number; nItem++){
 	if(lg->position >= 0) {
@@ -18438,6 +19092,7 @@ ParseFEN (Board board, int *blackPlaysFirst, char *fen, Boolean autoSize)
     ChessSquare piece, king = (gameInfo.variant == VariantKnightmate ? WhiteUnicorn : WhiteKing);
 
     p = fen;
+    board[KEY_STATE] = EmptySquare; // [HGM] hash: cached key no longer valid
 
     for(i=1; i<=deadRanks; i++) for(j=BOARD_LEFT; j<BOARD_RGHT; j++) board[BOARD_HEIGHT-i][j] = DarkSquare;
 
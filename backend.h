@@ -104,6 +104,8 @@ void Reset P((int redraw, int init));
 void ResetGameEvent P((void));
 Boolean HasPattern P(( const char * text, const char * pattern ));
 Boolean SearchPattern P(( const char * text, const char * pattern ));
+Boolean TagFilter P((char *filter));
+Boolean TagFilterMatch P((int number));
 int LoadGame P((FILE *f, int n, char *title, int useList));
 int LoadGameFromFile P((char *filename, int n, char *title, int useList));
 int CmailLoadGame P((FILE *f, int n, char *title, int useList));
@@ -211,16 +213,27 @@ void SaveToBook P((char *text));
 void AddBookMove P((char *text));
 void PlayBookMove P((char *text, int index));
 void HoverEvent P((int hiX, int hiY, int x, int y));
+void PackReset P((void));
+void PackResume P((int moves));
 int PackGame P((Board board));
+void PackEnd P((void));
 Boolean ParseFEN P((Board board, int *blackPlaysFirst, char *fen, Boolean autoSize));
 void ApplyMove P((int fromX, int fromY, int toX, int toY, int promoChar, Board board));
-void PackMove P((int fromX, int fromY, int toX, int toY, ChessSquare promoPiece));
+int PackMove P((int fromX, int fromY, int toX, int toY, ChessSquare promoPiece));
 void ics_printf P((char *format, ...));
 int GetEngineLine P((char *nick, int engine));
 void AddGameToBook P((int always));
 void FlushBook P((void));
+int BuildBook P((FILE *f));
+int CompactBookFile P((char *name, int minWeight, int *before));
+int Perft P((int depth));
+u64 PieceKey P((ChessSquare p, int r, int f));
+u64 PositionKey P((Board board, int whiteToMove));
+u64 PlacementKey P((Board board));
+void SetPlacementKey P((Board board, u64 key));
 char PieceToChar P((ChessSquare p));
 int LoadPieceDesc P((char *s));
+void CompilePieceDesc P((ChessSquare piece));
 
 char *StrStr P((char *string, char *match));
 char *StrCaseStr P((char *string, char *match));
@@ -273,12 +286,16 @@ extern ChessSquare gatingPiece;
 extern List gameList;
 extern int lastLoadGameNumber;
 void ClearGameInfo P((GameInfo *));
-int GameListBuild P((FILE *));
+int GameListBuild P((FILE *f, char *name));
+int PositionIndexSearch P((u64 *keys, int n));
+int PositionIndexHit P((int game));
 void GameListInitGameInfo P((GameInfo *));
 char *GameListLine P((int, GameInfo *));
 char * GameListLineFull P(( int, GameInfo *));
 void InitSearch P((void));
 int GameContainsPosition P((FILE *f, ListGame *lg));
+int *SearchGames P((FILE *f, int narrow, char *filter, int byTags));
+int UnpackGame P((ListGame *lg, int max, signed char (*moves)[5]));
 void GLT_TagsToList P(( char * tags ));
 void GLT_ParseList P((void));
 int NamesToList P((char *name, char **engines, char **mnemonics, char *group));
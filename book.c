@@ -40,8 +40,26 @@
 #include "frontend.h"
 #include "backend.h"
 #include "moves.h"
+#include "parser.h"
 #include "gettext.h"
 
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+# include <unistd.h>
+# include <sys/mman.h>
+# define MAPPING 1
+#endif
+
 #ifdef ENABLE_NLS
 # define  _(s) gettext (s)
 # define N_(s) gettext_noop (s)
@@ -286,10 +304,80 @@ uint64 *RandomTurn      =Random64+780;
 
 
 uint64
-hash (int moveNr)
-{
-    int r, f, p_enc, squareNr, pieceGroup;
-    uint64 key=0, holdingsKey=0, Zobrist;
+PieceKey (ChessSquare p, int r, int f)
+{   // Zobrist key of piece p on square (r,f), holdings squares included
+    int j = (int)p, promoted = 0, p_enc, squareNr, pieceGroup;
+    uint64 Zobrist;
+    j -= (j >= (int)BlackPawn) ? (int)BlackPawn :(int)WhitePawn;
+    if(j >= WhitePBishop && j != WhiteKing) promoted++, j -= WhiteTokin;
+    if(j > (int)WhiteQueen) j++;  // make space for King
+    if(j > (int) WhiteKing) j = (int)WhiteQueen + 1;
+    p_enc = 2*j + ((int)p < (int)BlackPawn);
+    // holdings squares get nmbers immediately after board; first left, then right holdings
+    if(f == BOARD_LEFT-2) squareNr = (BOARD_RGHT - BOARD_LEFT)*BOARD_HEIGHT + r; else
+    if(f == BOARD_RGHT+1) squareNr = (BOARD_RGHT - BOARD_LEFT + 1)*BOARD_HEIGHT + r; else
+    squareNr = (BOARD_RGHT - BOARD_LEFT)*r + (f - BOARD_LEFT);
+    // note that in normal Chess squareNr < 64 and p_enc < 12. The following code
+    // maps other pieces and squares in this range, and then modify the corresponding
+    // Zobrist random by rotating its bitpattern according to what the piece really was.
+    pieceGroup = p_enc / 12;
+    p_enc      = p_enc % 12;
+    Zobrist = RandomPiece[64*p_enc + (squareNr & 63)];
+    if(pieceGroup & 4) Zobrist *= 987654321;
+    switch(pieceGroup & 3) {
+	case 1: // pieces 5-10 (FEACWM)
+		Zobrist = (Zobrist << 16) ^ (Zobrist >> 48);
+		break;
+	case 2: // pieces 11-16 (OHIJGD)
+		Zobrist = (Zobrist << 32) ^ (Zobrist >> 32);
+		break;
+	case 3: // pieces 17-20 (VLSU)
+		Zobrist = (Zobrist << 48) ^ (Zobrist >> 16);
+		break;
+    }
+    if(promoted) Zobrist ^= 123456789*RandomPiece[squareNr & 63];
+    if(squareNr &  64) Zobrist = (Zobrist << 8) ^ (Zobrist >> 56);
+    if(squareNr & 128) Zobrist = (Zobrist << 4) ^ (Zobrist >> 60);
+    return Zobrist;
+}
+
+uint64
+PositionKey (Board board, int whiteToMove)
+{   // key of piece placement and side to move only, for finding positions irrespective of rights
+    int r, f;
+    uint64 key = whiteToMove ? RandomTurn[0] : 0;
+    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++)
+	if(board[r][f] != EmptySquare && board[r][f] != DarkSquare) key ^= PieceKey(board[r][f], r, f);
+    return key;
+}
+
+void
+SetPlacementKey (Board board, uint64 key)
+{   // [HGM] hash: cache the placement key in spare cells of the board, which CopyBoard copies along
+    board[KEY_LOW]  = (ChessSquare) (unsigned int) key;
+    board[KEY_HIGH] = (ChessSquare) (unsigned int) (key >> 32);
+    board[KEY_STATE] = (ChessSquare) KEY_SET;
+}
+
+uint64
+PlacementKey (Board board)
+{   // [HGM] hash: Polyglot key of the pieces on the board proper (not in holdings), from the cache if possible
+    int r, f;
+    uint64 key = 0;
+    if(board[KEY_STATE] == (ChessSquare) KEY_SET) // kept up to date by ApplyMove
+	return (uint64) (unsigned int) board[KEY_HIGH] << 32 | (unsigned int) board[KEY_LOW];
+    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++)
+	if(board[r][f] != EmptySquare) key ^= PieceKey(board[r][f], r, f);
+    SetPlacementKey(board, key);
+    return key;
+}
+
+uint64
+BoardKey (Board board, int whiteToMove)
+{   // Polyglot key of a position
+    int r, f;
+    uint64 key=0, holdingsKey=0;
+    ChessSquare p;
     VariantClass v = gameInfo.variant;
 
     switch(v) {
@@ -308,82 +396,52 @@ hash (int moveNr)
 	    key += v; // variant type incorporated in key to allow mixed books without collisions
     }
 
-    for(f=0; f<BOARD_WIDTH; f++){
-        for(r=0; r<BOARD_HEIGHT;r++){
-            ChessSquare p = boards[moveNr][r][f];
-	    if(f == BOARD_LEFT-1 || f == BOARD_RGHT) continue; // between board and holdings
-            if(p != EmptySquare){
-		    int j = (int)p, promoted = 0;
-		    j -= (j >= (int)BlackPawn) ? (int)BlackPawn :(int)WhitePawn;
-		    if(j >= WhitePBishop && j != WhiteKing) promoted++, j -= WhiteTokin;
-		    if(j > (int)WhiteQueen) j++;  // make space for King
-		    if(j > (int) WhiteKing) j = (int)WhiteQueen + 1;
-		    p_enc = 2*j + ((int)p < (int)BlackPawn);
-		    // holdings squares get nmbers immediately after board; first left, then right holdings
-		    if(f == BOARD_LEFT-2) squareNr = (BOARD_RGHT - BOARD_LEFT)*BOARD_HEIGHT + r; else
-		    if(f == BOARD_RGHT+1) squareNr = (BOARD_RGHT - BOARD_LEFT + 1)*BOARD_HEIGHT + r; else
-		    squareNr = (BOARD_RGHT - BOARD_LEFT)*r + (f - BOARD_LEFT);
-		    // note that in normal Chess squareNr < 64 and p_enc < 12. The following code
-		    // maps other pieces and squares in this range, and then modify the corresponding
-		    // Zobrist random by rotating its bitpattern according to what the piece really was.
-		    pieceGroup = p_enc / 12;
-		    p_enc      = p_enc % 12;
-		    Zobrist = RandomPiece[64*p_enc + (squareNr & 63)];
-		    if(pieceGroup & 4) Zobrist *= 987654321;
-		    switch(pieceGroup & 3) {
-			case 1: // pieces 5-10 (FEACWM)
-				Zobrist = (Zobrist << 16) ^ (Zobrist >> 48);
-				break;
-			case 2: // pieces 11-16 (OHIJGD)
-				Zobrist = (Zobrist << 32) ^ (Zobrist >> 32);
-				break;
-			case 3: // pieces 17-20 (VLSU)
-				Zobrist = (Zobrist << 48) ^ (Zobrist >> 16);
-				break;
-		    }
-		    if(promoted) Zobrist ^= 123456789*RandomPiece[squareNr & 63];
-		    if(squareNr &  64) Zobrist = (Zobrist << 8) ^ (Zobrist >> 56);
-		    if(squareNr & 128) Zobrist = (Zobrist << 4) ^ (Zobrist >> 60);
-		    // holdings have separate (additive) key, to encode presence of multiple pieces on same square
-		    if(f == BOARD_LEFT-2) holdingsKey += Zobrist * boards[moveNr][r][f+1]; else
-		    if(f == BOARD_RGHT+1) holdingsKey += Zobrist * boards[moveNr][r][f-1]; else
-                key ^= Zobrist;
-            }
-        }
+    key ^= PlacementKey(board);
+    // holdings have separate (additive) key, to encode presence of multiple pieces on same square
+    if(gameInfo.holdingsWidth > 1) for(r=0; r<BOARD_HEIGHT; r++) {
+	if((p = board[r][BOARD_LEFT-2]) != EmptySquare) holdingsKey += PieceKey(p, r, BOARD_LEFT-2) * board[r][BOARD_LEFT-1];
+	if((p = board[r][BOARD_RGHT+1]) != EmptySquare) holdingsKey += PieceKey(p, r, BOARD_RGHT+1) * board[r][BOARD_RGHT];
     }
 
-    if(boards[moveNr][CASTLING][2] != NoRights) {
-	if(boards[moveNr][CASTLING][0] != NoRights) key^=RandomCastle[0];
-	if(boards[moveNr][CASTLING][1] != NoRights) key^=RandomCastle[1];
+    if(board[CASTLING][2] != NoRights) {
+	if(board[CASTLING][0] != NoRights) key^=RandomCastle[0];
+	if(board[CASTLING][1] != NoRights) key^=RandomCastle[1];
     }
-    if(boards[moveNr][CASTLING][5] != NoRights) {
-	if(boards[moveNr][CASTLING][3] != NoRights) key^=RandomCastle[2];
-	if(boards[moveNr][CASTLING][4] != NoRights) key^=RandomCastle[3];
+    if(board[CASTLING][5] != NoRights) {
+	if(board[CASTLING][3] != NoRights) key^=RandomCastle[2];
+	if(board[CASTLING][4] != NoRights) key^=RandomCastle[3];
     }
 
-    f = boards[moveNr][EP_STATUS];
+    f = board[EP_STATUS];
     if(f >= 0 && f < 8){
-        if(!WhiteOnMove(moveNr)){
+        if(!whiteToMove){
 	    // the test for neighboring Pawns might not be needed,
 	    // as epStatus already kept track of it, but better safe than sorry.
-            if((f>0 && boards[moveNr][3][f-1]==BlackPawn)||
-               (f<7 && boards[moveNr][3][f+1]==BlackPawn)){
+            if((f>0 && board[3][f-1]==BlackPawn)||
+               (f<7 && board[3][f+1]==BlackPawn)){
                 key^=RandomEnPassant[f];
             }
         }else{
-            if((f>0 && boards[moveNr][4][f-1]==WhitePawn)||
-               (f<7 && boards[moveNr][4][f+1]==WhitePawn)){
+            if((f>0 && board[4][f-1]==WhitePawn)||
+               (f<7 && board[4][f+1]==WhitePawn)){
                 key^=RandomEnPassant[f];
             }
         }
     }
 
-    if(WhiteOnMove(moveNr)){
+    if(whiteToMove){
         key^=RandomTurn[0];
     }
     return key + holdingsKey;
 }
 
+uint64
+hash (int moveNr)
+{
+    if(gameMode == EditPosition) boards[moveNr][KEY_STATE] = EmptySquare; // [HGM] hash: board could be edited behind our back
+    return BoardKey(boards[moveNr], WhiteOnMove(moveNr));
+}
+
 #define MOVE_BUF 100
 
 // fs routines read from memory buffer if no file specified
@@ -454,34 +512,93 @@ entry_from_file (FILE *f, entry_t *entry)
     return 0;
 }
 
+// [HGM] mapped book: book files opened for probing are kept open, and mapped in memory where
+//       the OS allows it, so that probing them needs no seeks or system calls.
+
+#define NR_BOOKS 8
+
+typedef struct {
+    char *name;
+    FILE *f;
+    unsigned char *base; // start of its 16-byte big-endian entries, when mapped
+    int len;             // number of mapped entries
+    long size;           // file size and time when last checked, to detect rewriting
+    time_t mtime;
+} BookFile;
+
+static BookFile books[NR_BOOKS];
+
+static uint64
+from_bytes (unsigned char *p, int l)
+{
+    uint64 r = 0;
+    while(l--) r = r<<8 | *p++;
+    return r;
+}
+
+static uint64
+key_at (FILE *f, unsigned char *base, int n)
+{   // key of entry n, wherever the book lives
+    uint64 r = 0;
+    if(base) return from_bytes(base + 16*n, 8);
+    if(!f) return ((entry_t *) memBuf)[n].key; // memory buffer is in native format
+    fsseek(f, 16*n, SEEK_SET);
+    int_from_file(f, 8, &r);
+    return r;
+}
+
+static int
+lower_bound (FILE *f, unsigned char *base, int n, uint64 key)
+{   // index of first of the n entries with key >= given key (n if none)
+    // Polyglot keys are uniformly distributed, so interpolating between the keys that bracket the
+    // range lands close to the wanted entry. From there we gallop towards it with doubling steps
+    // until it is bracketed from the other side, and interpolate again within the bracket. This
+    // needs only a few probes, close together, where bisection needs log2(n) probes all over the
+    // file. Bisection takes over after some rounds, so a skewed book cannot make it much worse.
+    int first = 0, last = n, guess, step, steps = 0;
+    uint64 lo = 0, hi = ~(uint64)0, k;
+    while(last - first > 4) {
+	if(steps++ < 3 && hi > lo) {
+	    guess = first + (int) ((double) (key - lo) / (double) (hi - lo) * (last - first));
+	    if(guess < first) guess = first; else if(guess >= last) guess = last - 1;
+	    step = 2*sqrt(last - first) + 1;
+	} else guess = (first + last) >> 1, step = 0;
+	k = key_at(f, base, guess);
+	if(k < key) {
+	    first = guess + 1, lo = k;
+	    while(step && guess + step < last) { // gallop upward
+		k = key_at(f, base, guess += step);
+		if(k >= key) { last = guess, hi = k; break; }
+		first = guess + 1, lo = k, step *= 2;
+	    }
+	} else {
+	    last = guess, hi = k;
+	    while(step && guess - step >= first) { // gallop downward
+		k = key_at(f, base, guess -= step);
+		if(k < key) { first = guess + 1, lo = k; break; }
+		last = guess, hi = k, step *= 2;
+	    }
+	}
+    }
+    while(first < last && key_at(f, base, first) < key) first++; // the last few are on the same page
+    return first;
+}
+
 int
 find_key (FILE *f, uint64 key, entry_t *entry)
 {
-    int first, last, middle;
-    entry_t last_entry,middle_entry;
-    first=-1;
+    int n, found;
     if(fsseek(f,-16,SEEK_END)){
         *entry=entry_none;
         entry->key=key+1; //hack
         return -1;
     }
-    last=fstell(f)/16;
-    entry_from_file(f,&last_entry);
-    while(1){
-        if(last-first==1){
-            *entry=last_entry;
-            return last;
-        }
-        middle=(first+last)/2;
-        fsseek(f,16*middle,SEEK_SET);
-        entry_from_file(f,&middle_entry);
-        if(key<=middle_entry.key){
-            last=middle;
-            last_entry=middle_entry;
-        }else{
-            first=middle;
-        }
-    }
+    n=fstell(f)/16 + 1;
+    found=lower_bound(f, NULL, n, key);
+    if(found == n) found--; // no key as large; report the last entry
+    fsseek(f,16*found,SEEK_SET);
+    entry_from_file(f,entry);
+    return found;
 }
 
 static int xStep[] = { 0, 1, 1, 1, 0,-1,-1,-1 };
@@ -546,18 +663,35 @@ move_to_string (char move_s[20], uint16 move)
     }
 }
 
-int
-GetBookMoves (FILE *f, int moveNr, entry_t entries[], int max)
-{   // retrieve all entries for given position from book in 'entries', return number.
+static void
+entry_from_bytes (unsigned char *p, entry_t *entry)
+{
+    entry->key         = from_bytes(p, 8);
+    entry->move        = from_bytes(p + 8, 2);
+    entry->weight      = from_bytes(p + 10, 2);
+    entry->learnCount  = from_bytes(p + 12, 2);
+    entry->learnPoints = from_bytes(p + 14, 2);
+}
+
+static void
+entry_to_bytes (unsigned char *p, entry_t *entry)
+{
+    int i;
+    for(i=0; i<8; i++) p[i] = entry->key >> 8*(7-i) & 255;
+    p[8]  = entry->move >> 8;       p[9]  = entry->move & 255;
+    p[10] = entry->weight >> 8;     p[11] = entry->weight & 255;
+    p[12] = entry->learnCount >> 8; p[13] = entry->learnCount & 255;
+    p[14] = entry->learnPoints >> 8; p[15] = entry->learnPoints & 255;
+}
+
+static int
+FileMoves (FILE *f, uint64 key, entry_t entries[], int max)
+{   // retrieve all entries for given key from book file (or memory buffer) in 'entries', return number.
     entry_t entry;
     int offset;
-    uint64 key;
     int count;
     int ret;
 
-    key = hash(moveNr);
-    if(appData.debugMode) fprintf(debugFP, "book key = %08x%08x\n", (unsigned int)(key>>32), (unsigned int)key);
-
     offset=find_key(f, key, &entry);
     if(entry.key != key) {
 	  return FALSE;
@@ -579,28 +713,199 @@ GetBookMoves (FILE *f, int moveNr, entry_t entries[], int max)
     return count;
 }
 
+int
+GetBookMoves (FILE *f, int moveNr, entry_t entries[], int max)
+{   // retrieve all entries for given position from book in 'entries', return number.
+    uint64 key;
+
+    key = hash(moveNr);
+    if(appData.debugMode) fprintf(debugFP, "book key = %08x%08x\n", (unsigned int)(key>>32), (unsigned int)key);
+
+    return FileMoves(f, key, entries, max);
+}
+
+static int
+BookMoves (BookFile *b, uint64 key, entry_t entries[], int max)
+{   // same for an opened book, which might be mapped
+    int first, count = 0;
+    if(!b->base) return FileMoves(b->f, key, entries, max);
+    first = lower_bound(NULL, b->base, b->len, key);
+    while(first < b->len && count < max && from_bytes(b->base + 16*first, 8) == key)
+	entry_from_bytes(b->base + 16*first++, entries + count++);
+    return count;
+}
+
+// [HGM] probe cache: book probes are remembered per (book, key) in a small LRU cache, as in a match
+//       every game goes through the same few opening lines. Misses are remembered too.
+
+#define CACHE_SIZE 1024 /* power of 2 */
+
+static struct {
+    uint64 key;
+    int book, count;
+    entry_t *entries;
+    int next;           // hash chain, +1 so that 0 ends it
+    int older, newer;   // LRU list, -1 ends it
+} cache[CACHE_SIZE];
+static int bucket[CACHE_SIZE], cacheUsed, newest = -1, oldest = -1;
+
+static void
+FlushProbeCache ()
+{
+    int i;
+    for(i=0; i<cacheUsed; i++) free(cache[i].entries);
+    for(i=0; i<CACHE_SIZE; i++) bucket[i] = 0;
+    cacheUsed = 0; newest = oldest = -1;
+}
+
+static void
+Unlink (int n)
+{
+    if(cache[n].older >= 0) cache[cache[n].older].newer = cache[n].newer; else oldest = cache[n].newer;
+    if(cache[n].newer >= 0) cache[cache[n].newer].older = cache[n].older; else newest = cache[n].older;
+}
+
+static void
+MakeNewest (int n)
+{
+    cache[n].older = newest; cache[n].newer = -1;
+    if(newest >= 0) cache[newest].newer = n; else oldest = n;
+    newest = n;
+}
+
+static int
+CachedMoves (int book, uint64 key, entry_t entries[])
+{   // retrieve entries for given key from given book, preferably from the cache
+    int h = (key ^ book) & (CACHE_SIZE-1), n, count, *p;
+    entry_t *copy = NULL;
+    for(n = bucket[h]; n; n = cache[n-1].next) if(cache[n-1].key == key && cache[n-1].book == book) break;
+    if(n--) { // hit
+	Unlink(n); MakeNewest(n);
+	if(cache[n].count) memcpy(entries, cache[n].entries, cache[n].count*sizeof(entry_t));
+	return cache[n].count;
+    }
+    count = BookMoves(books + book, key, entries, MOVE_BUF);
+    if(count > 0 && !(copy = malloc(count*sizeof(entry_t)))) return count; // cannot cache them; do not record a miss
+    if(cacheUsed < CACHE_SIZE) n = cacheUsed++; else { // recycle least-recently used entry
+	n = oldest; Unlink(n);
+	for(p = bucket + ((cache[n].key ^ cache[n].book) & (CACHE_SIZE-1)); *p != n+1; p = &cache[*p-1].next);
+	*p = cache[n].next;
+	free(cache[n].entries);
+    }
+    cache[n].key = key; cache[n].book = book; cache[n].count = (copy ? count : 0);
+    if((cache[n].entries = copy)) memcpy(copy, entries, count*sizeof(entry_t));
+    cache[n].next = bucket[h]; bucket[h] = n+1;
+    MakeNewest(n);
+    return count;
+}
+
+static void
+CloseBook (BookFile *b)
+{
+#ifdef MAPPING
+    if(b->base) munmap(b->base, 16*b->len);
+#endif
+    if(b->f) fclose(b->f);
+    free(b->name);
+    b->name = NULL; b->f = NULL; b->base = NULL;
+}
+
+static int
+CheckBook (BookFile *b)
+{   // map the (already opened) book file, if possible. Return TRUE if it was rewritten since last time.
+    struct stat st;
+    int changed;
+#ifdef MAPPING
+    void *p;
+#endif
+    if(fstat(fileno(b->f), &st) || (st.st_mode & S_IFMT) != S_IFREG) st.st_size = 0;
+    changed = (st.st_size != b->size || st.st_mtime != b->mtime);
+    b->size = st.st_size; b->mtime = st.st_mtime;
+#ifdef MAPPING
+    if(b->base && changed) munmap(b->base, 16*b->len), b->base = NULL; // a shrunk mapping would fault
+    if(b->base || st.st_size < 16 || st.st_size > 0x7FFFFFF0) return changed; // entry offsets must fit in an int
+    p = mmap(NULL, st.st_size & ~15, PROT_READ, MAP_SHARED, fileno(b->f), 0);
+    if(p != MAP_FAILED) b->base = p, b->len = st.st_size/16;
+#endif
+    return changed;
+}
+
 static int dirty;
 
+static BookFile *
+OpenBook (char *name)
+{   // return the named book, opening it if it was not yet open
+    static int victim;
+    int i, slot = -1;
+    if(dirty) { // book was written: start afresh
+	for(i=0; i<NR_BOOKS; i++) if(books[i].name) CloseBook(books + i);
+	FlushProbeCache();
+	dirty = 0;
+    }
+    for(i=0; i<NR_BOOKS; i++) {
+	if(!books[i].name) { if(slot < 0) slot = i; continue; }
+	if(strcmp(books[i].name, name)) continue;
+	if(CheckBook(books + i)) FlushProbeCache(); // stale results
+	return books + i;
+    }
+    if(slot < 0) { // all in use: close one
+	CloseBook(books + (slot = victim));
+	victim = (victim + 1) % NR_BOOKS;
+	FlushProbeCache(); // it might still have results in there
+    }
+    if(!(books[slot].f = fopen(name, "rb"))) return NULL;
+    books[slot].name = strdup(name);
+    books[slot].size = -1;
+    CheckBook(books + slot);
+    return books + slot;
+}
+
 int
 ReadFromBookFile (int moveNr, char *book, entry_t entries[])
 {   // retrieve all entries for given position from book in 'entries', return number.
-    static FILE *f = NULL;
-    static char curBook[MSG_SIZ];
+    BookFile *b;
+    uint64 key;
 
     if(book == NULL) return -1;
-    if(dirty) { if(f) fclose(f); dirty = 0; f = NULL; }
-    if(!f || strcmp(book, curBook)){ // keep book file open until book changed
-	strncpy(curBook, book, MSG_SIZ);
-	if(f) fclose(f);
-	f = fopen(book,"rb");
-    }
-    if(!f){
+    if(!(b = OpenBook(book))) {
 	DisplayError(_("Polyglot book not valid"), 0);
 	appData.usePolyglotBook = FALSE;
 	return -1;
     }
 
-    return GetBookMoves(f, moveNr, entries, MOVE_BUF);
+    key = hash(moveNr);
+    if(appData.debugMode) fprintf(debugFP, "book key = %08x%08x\n", (unsigned int)(key>>32), (unsigned int)key);
+
+    return CachedMoves(b - books, key, entries);
+}
+
+static int
+CascadeMoves (int moveNr, entry_t entries[])
+{   // [HGM] cascade: probe the extra books in the given order, each up to its own depth, until one has a hit
+    char *p = appData.bookCascade, *q, name[MSG_SIZ];
+    int depth, count, len;
+    uint64 key = 0;
+    BookFile *b;
+
+    while(p && *p) {
+	while(*p == ';' || *p == ' ') p++;
+	len = strcspn(p, ";");
+	snprintf(name, MSG_SIZ, "%.*s", len, p);
+	p += len;
+	depth = appData.bookDepth;
+	if((q = strrchr(name, '@')) && q[1] && strspn(q+1, "0123456789") == strlen(q+1)) depth = atoi(q+1), *q = NULLCHAR;
+	if(!*name || moveNr >= 2*depth) continue;
+	if(!(b = OpenBook(name))) {
+	    if(appData.debugMode) fprintf(debugFP, "could not open book %s\n", name);
+	    continue;
+	}
+	if(!key) key = hash(moveNr);
+	if((count = CachedMoves(b - books, key, entries)) > 0) {
+	    if(appData.debugMode) fprintf(debugFP, "book hit in %s\n", name);
+	    return count;
+	}
+    }
+    return 0;
 }
 
 // next three made into subroutines to facilitate future changes in storage scheme (e.g. 2 x 3 bytes)
@@ -619,31 +924,51 @@ losses(entry_t *e)
 
 static void
 CountMove (entry_t *e, int result)
-{
-    switch(result) {
-      case 0: e->learnCount ++; break;
-      case 1: e->learnCount ++; // count draw as win + loss
-      case 2: e->learnPoints ++; break;
-    }
+{   // count draw as win + loss; counters saturate
+    if(result < 2 && e->learnCount  < 0xFFFF) e->learnCount ++;
+    if(result > 0 && e->learnPoints < 0xFFFF) e->learnPoints ++;
+}
+
+static void
+AddLearned (entry_t *e, entry_t *d)
+{   // add the learn counts of d to those of e, saturating; while learning the weight counts the games
+    int count = e->learnCount + d->learnCount, points = e->learnPoints + d->learnPoints, games = e->weight + d->weight;
+    e->learnCount  = count  > 0xFFFF ? 0xFFFF : count;
+    e->learnPoints = points > 0xFFFF ? 0xFFFF : points;
+    e->weight      = games  > 0xFFFF ? 0xFFFF : games;
 }
 
 #define MERGESIZE 2048
 #define HASHSIZE  1024*1024*4
 
 entry_t *memBook, *hashTab, *mergeBuf;
-int bookSize=1, mergeSize=1, mask = HASHSIZE-1;
+int bookSize=1, mergeSize=1, mask = HASHSIZE-1, memSize;
+
+static void ReadMemBook P((void));
+
+static int
+GrowMemBook (int size)
+{   // make sure memBook has room for size entries
+    entry_t *p;
+    if(size <= memSize) return TRUE;
+    size += size >> 2;
+    if(!(p = (entry_t *) realloc(memBook, size * sizeof(entry_t)))) return FALSE;
+    memBook = p; memSize = size;
+    return TRUE;
+}
 
 void
 InitMemBook ()
 {
     static int initDone = FALSE;
     if(initDone) return;
-    memBook  = (entry_t *) calloc(1024*1024, sizeof(entry_t));
+    memBook  = (entry_t *) calloc(memSize = 1024*1024, sizeof(entry_t));
     hashTab  = (entry_t *) calloc(HASHSIZE,  sizeof(entry_t));
     mergeBuf = (entry_t *) calloc(MERGESIZE+5, sizeof(entry_t));
     memBook[0].key  = -1LL;
     mergeBuf[0].key = -1LL;
     initDone = TRUE;
+    if(mcMode) ReadMemBook(); // [HGM] learn: continue from what earlier sessions learned
 }
 
 char *
@@ -693,10 +1018,13 @@ char
     static char move_s[6];
     int total_weight;
 
-    if(moveNr >= 2*appData.bookDepth) return NULL;
-    if(mcMode) return MCprobe(moveNr);
+    if(mcMode) return moveNr < 2*appData.bookDepth ? MCprobe(moveNr) : NULL;
 
-    if((count = ReadFromBookFile(moveNr, book, entries)) <= 0) return NULL; // no book, or no hit
+    count = 0;
+    if(moveNr < 2*appData.bookDepth && ((book && *book) || !*appData.bookCascade))
+	count = ReadFromBookFile(moveNr, book, entries);
+    if(count <= 0) count = CascadeMoves(moveNr, entries); // try the other books
+    if(count <= 0) return NULL; // no book, or no hit
 
     if(appData.bookStrength != 50) { // transform weights
         double power = 0, maxWeight = 0.0;
@@ -729,17 +1057,97 @@ char
 extern char yy_textstr[];
 entry_t lastEntries[MOVE_BUF];
 
+// [HGM] explorer: the book window also shows what the book has on the position after each move:
+//       the number of replies there, and their learn counts summed (from the viewpoint of the side
+//       that made the move). These include all games that reached that position, so when they are
+//       more than those of the move itself, the surplus must have come in through transpositions.
+
+typedef struct {
+    uint64 key;
+    int replies, points, count; // replies < 0 if the position could not be probed
+} child_t;
+
+static int
+ChildKey (int moveNr, uint16 move, uint64 *key)
+{   // key of the position after the given book move; FALSE if we cannot play it
+    char move_s[20], c1, c2, c3 = NULLCHAR;
+    int i1, i2, fromX, fromY, toX, toY;
+    Board board;
+
+    move_to_string(move_s, move);
+    if(strchr(move_s, ',')) return FALSE; // multi-leg moves are not worth the trouble
+    if(move_s[1] == '@') { // drop
+	if(sscanf(move_s+2, "%c%d%c", &c2, &i2, &c3) < 2) return FALSE;
+	fromX = CharToPiece(WhiteOnMove(moveNr) ? move_s[0] : ToLower(move_s[0])); fromY = DROP_RANK;
+	if(fromX == EmptySquare) return FALSE;
+    } else {
+	if(sscanf(move_s, "%c%d%c%d%c", &c1, &i1, &c2, &i2, &c3) < 4) return FALSE;
+	fromX = c1 - AAA; fromY = i1 - ONE + '0';
+	if(fromX < BOARD_LEFT || fromX >= BOARD_RGHT || fromY < 0 || fromY >= BOARD_HEIGHT) return FALSE;
+    }
+    toX = c2 - AAA; toY = i2 - ONE + '0';
+    if(toX < BOARD_LEFT || toX >= BOARD_RGHT || toY < 0 || toY >= BOARD_HEIGHT) return FALSE; // corrupt entry
+    CopyBoard(board, boards[moveNr]);
+    ApplyMove(fromX, fromY, toX, toY, c3, board);
+    *key = BoardKey(board, !WhiteOnMove(moveNr));
+    return TRUE;
+}
+
+static int
+CompareChildren (const void *a, const void *b)
+{
+    const child_t *c1 = *(child_t **) a, *c2 = *(child_t **) b;
+    return c1->key < c2->key ? -1 : c1->key > c2->key;
+}
+
+static void
+Tally (child_t *c, entry_t *e)
+{   // the learn counts of the replies are from the viewpoint of the opponent
+    c->replies++;
+    c->points += e->learnCount;
+    c->count  += e->learnPoints;
+}
+
+static void
+ProbeChildren (char *book, int moveNr, int count, entry_t entries[], child_t children[])
+{   // look up the positions after all the book moves, in key order, so that on a mapped book
+    // each search can start where the previous one ended, and the whole batch is done in one
+    // forward sweep through the file. This also keeps the probe cache free of them.
+    child_t **order = malloc(count * sizeof(child_t *));
+    entry_t e[MOVE_BUF];
+    BookFile *b;
+    int i, j, n = 0, first = 0;
+
+    for(i=0; i<count; i++) children[i].replies = -1;
+    if(!order || !book || !(b = OpenBook(book))) { free(order); return; }
+    for(i=0; i<count; i++) if(ChildKey(moveNr, entries[i].move, &children[i].key)) order[n++] = children + i;
+    qsort(order, n, sizeof(child_t *), CompareChildren);
+    for(i=0; i<n; i++) {
+	child_t *c = order[i];
+	c->replies = c->points = c->count = 0;
+	if(b->base) { // mapped: the keys to find only go up, so neither does the search range
+	    first += lower_bound(NULL, b->base + 16*first, b->len - first, c->key);
+	    for(j=first; j<b->len && from_bytes(b->base + 16*j, 8) == c->key; j++) {
+		entry_from_bytes(b->base + 16*j, e);
+		Tally(c, e);
+	    }
+	} else for(j=FileMoves(b->f, c->key, e, MOVE_BUF); j-- > 0; ) Tally(c, e + j);
+    }
+    free(order);
+}
+
 char *
-MovesToText(int count, entry_t *entries)
+MovesToText(int count, entry_t *entries, child_t *children)
 {
-	int i, totalWeight = 0;
+	int i, totalWeight = 0, len = 0, size = 128*count+1, n;
 	char algMove[12];
-	char *p = (char*) malloc(40*count+1);
+	char *p = (char*) malloc(size);
 	for(i=0; i<count; i++) totalWeight += entries[i].weight;
 	*p = 0;
 	for(i=0; i<count; i++) {
-	    char buf[MSG_SIZ], c1, c2, c3; int i1, i2, i3;
+	    char buf[MSG_SIZ], line[MSG_SIZ+40], c1, c2, c3; int i1, i2, i3, l;
 	    move_to_string(algMove, entries[i].move);
+	    c3 = NULLCHAR;
 	    if(sscanf(algMove, "%c%d%*c%*d,%c%d%c%d", &c1, &i1, &c2, &i2, &c3, &i3) == 6)
 		snprintf(algMove, 12, "%c%dx%c%d-%c%d", c1, i1, c2, i2, c3, i3); // cast double-moves in format SAN parser will understand
 	    else if(sscanf(algMove, "%c%d%c%d%c", &c1, &i1, &c2, &i2, &c3) >= 4) {
@@ -748,8 +1156,18 @@ MovesToText(int count, entry_t *entries)
 	    buf[0] = NULLCHAR;
 	    if(entries[i].learnCount || entries[i].learnPoints)
 		snprintf(buf, MSG_SIZ, " {%d/%d}", entries[i].learnPoints, entries[i].learnCount);
-	    snprintf(p+strlen(p), 40, "%5.1f%% %5d %s%s\n", 100*entries[i].weight/(totalWeight+0.001),
-					entries[i].weight, algMove, buf);
+	    if(children && children[i].replies >= 0) { // explorer info, which TextToMoves will skip
+		child_t *c = children + i;
+		int transposed = c->points + c->count - entries[i].learnPoints - entries[i].learnCount;
+		l = strlen(buf); snprintf(buf+l, MSG_SIZ-1-l, "  [%d %s", c->replies, c->replies == 1 ? _("reply") : _("replies"));
+		if(c->points || c->count) l = strlen(buf), snprintf(buf+l, MSG_SIZ-1-l, " {%d/%d}", c->points, c->count);
+		if(transposed > 0) l = strlen(buf), snprintf(buf+l, MSG_SIZ-1-l, ", +%d %s", transposed, _("transposed"));
+		strcat(buf, "]"); // room for it was kept
+	    }
+	    n = snprintf(line, MSG_SIZ+40, "%5.1f%% %5d %s%s\n", 100*entries[i].weight/(totalWeight+0.001),
+					entries[i].weight, algMove, buf); // always fits, '\n' included
+	    if(len + n >= size) p = (char*) realloc(p, size = len + n + 128*(count-i)); // long (translated) texts
+	    strcpy(p + len, line); len += n;
 //lastEntries[i] = entries[i];
 	}
 	return p;
@@ -809,6 +1227,7 @@ TextToMoves (char *text, int moveNum, entry_t *entries)
 		entries[count].learnPoints = 0;
 		entries[count].learnCount  = 0;
 	    }
+	    if(!strncmp(text, "  [", 3) && strchr(text, ']')) text = strchr(text, ']') + 1; // explorer info
 	    entries[count].move = CoordsToMove(fromX, fromY, toX, toY, promoChar); killX = killY = -1;
 	    entries[count].key  = hashKey;
 	    entries[count].weight = w;
@@ -824,12 +1243,14 @@ Boolean
 DisplayBook (int moveNr)
 {
     entry_t entries[MOVE_BUF];
+    child_t children[MOVE_BUF];
     int count;
     char *p;
     if(!bookUp) return FALSE;
     count = currentCount = ReadFromBookFile(moveNr, appData.polyglotBook, entries);
     if(count < 0) return FALSE;
-    p = MovesToText(count, entries);
+    ProbeChildren(appData.polyglotBook, moveNr, count, entries, children);
+    p = MovesToText(count, entries, children);
     EditTagsPopUp(p, NULL);
     free(p);
     addToBookFlag = FALSE;
@@ -909,6 +1330,7 @@ NewEntry (entry_t *e, uint64 key, int move, int result)
     e->move = move;
     e->learnPoints = 0;
     e->learnCount = 0;
+    e->weight = 1; // one game
     CountMove(e, result);
 }
 
@@ -918,6 +1340,7 @@ Merge ()
     int i;
 
     if(appData.debugMode) fprintf(debugFP, "book merge %d moves (old size %d)\n", mergeSize, bookSize);
+    if(!GrowMemBook(bookSize + mergeSize)) DisplayFatalError(_("Book too large for memory"), 0, 1);
 
     bookSize += --mergeSize;
     for(i=bookSize-1; mergeSize; i--) {
@@ -931,35 +1354,37 @@ Merge ()
     mergeBuf[0].key = -1LL;
 }
 
-void
-AddToBook (int moveNr, int result)
-{
-    entry_t entry;
-    int offset, start, move;
-    uint64 key;
-    int i, j, fromY, toY;
-    char fromX, toX, promo;
 extern char moveList[][MOVE_LEN];
 
-    if(!moveList[moveNr][0] || moveList[moveNr][0] == '\n') return; // could be terminal position
-
-    if(appData.debugMode) fprintf(debugFP, "add move %d to book %s", moveNr, moveList[moveNr]);
-
-    // calculate key and book representation of move
-    key = hash(moveNr);
+static int
+ListMove (int moveNr)
+{   // book representation of the move played in position moveNr
+    int fromY, toY;
+    char fromX, toX, promo = NULLCHAR;
     if(moveList[moveNr][1] == '@') {
 	sscanf(moveList[moveNr], "%c@%c%d", &promo, &toX, &toY);
 	fromX = CharToPiece(WhiteOnMove(moveNr) ? ToUpper(promo) : ToLower(promo));
 	fromY = DROP_RANK; promo = NULLCHAR;
     } else sscanf(moveList[moveNr], "%c%d%c%d%c", &fromX, &fromY, &toX, &toY, &promo), fromX -= AAA, fromY -= ONE - '0';
-    move = CoordsToMove(fromX, fromY, toX-AAA, toY-ONE+'0', promo);
+    return CoordsToMove(fromX, fromY, toX-AAA, toY-ONE+'0', promo);
+}
+
+static void
+LearnMove (entry_t *d)
+{   // add the learn counts of a move to the memory book
+    uint64 key = d->key;
+    int move = d->move;
+    entry_t entry;
+    int offset, start, known;
+    int i, j;
 
     // if move already in book, just add count
     memBuf = (unsigned char*) memBook; bufSize = bookSize;   // in MC mode book resides in memory
     offset = find_key(NULL, key, &entry);
+    known = memBook[offset].key == key;
     while(memBook[offset].key == key) {
 	if(memBook[offset].move == move) {
-	    CountMove(memBook+offset, result); return;
+	    AddLearned(memBook+offset, d); return;
 	} else offset++;
     }
     // move did not occur in the main book
@@ -968,13 +1393,14 @@ extern char moveList[][MOVE_LEN];
     while(mergeBuf[offset].key == key) {
 	if(mergeBuf[offset].move == move) {
             if(appData.debugMode) fprintf(debugFP, "found in book merge buf @ %d\n", offset);
-	    CountMove(mergeBuf+offset, result); return;
+	    AddLearned(mergeBuf+offset, d); return;
 	} else offset++;
     }
-    if(start != offset) { // position was in mergeBuf, but move is new
+    if(start != offset || known) { // position was in mergeBuf or book, but move is new
         if(appData.debugMode) fprintf(debugFP, "add in book merge buf @ %d\n", offset);
 	for(i=mergeSize++; i>offset; i--) mergeBuf[i] = mergeBuf[i-1]; // make room
-	NewEntry(mergeBuf+offset, key, move, result);
+	mergeBuf[offset] = *d;
+	if(mergeSize >= MERGESIZE) Merge();
 	return;
     }
     // position was not in mergeBuf; look in hash table
@@ -983,12 +1409,12 @@ extern char moveList[][MOVE_LEN];
 	if(hashTab[i].key == 1 && offset < 0) offset = i; // remember first invalidated entry we pass
 	if(!((hashTab[i].key - key) & ~1)) { // hit
 	    if(hashTab[i].move == move) {
-		CountMove(hashTab+i, result);
+		AddLearned(hashTab+i, d);
 		for(j=mergeSize++; j>start; j--) mergeBuf[j] = mergeBuf[j-1];
 	    } else {
 		// position already in hash now occurs with different move; move both moves to mergeBuf
 		for(j=mergeSize+1; j>start+1; j--) mergeBuf[j] = mergeBuf[j-2];
-		NewEntry(mergeBuf+start+1, key, move, result); mergeSize += 2;
+		mergeBuf[start+1] = *d; mergeSize += 2;
 	    }
 	    hashTab[i].key = 1; // kludge to invalidate hash entry
 	    mergeBuf[start] = hashTab[i]; mergeBuf[start].key = key;
@@ -997,13 +1423,234 @@ extern char moveList[][MOVE_LEN];
  	}
 	i = i+1 & mask; // wrap!
     }
+    if(d->weight > 1) { // summed journal record of several games, so it goes to the book right away
+	for(j=mergeSize++; j>start; j--) mergeBuf[j] = mergeBuf[j-1];
+	mergeBuf[start] = *d;
+	if(mergeSize >= MERGESIZE) Merge();
+	return;
+    }
     // position did not yet occur in hash table. Put it there
     if(offset < 0) offset = i;
-    NewEntry(hashTab+offset, key, move, result);
+    hashTab[offset] = *d;
     if(appData.debugMode)
 	fprintf(debugFP, "book hash @ %d (%d-%d)\n", offset, hashTab[offset].learnPoints, hashTab[offset].learnCount);
 }
 
+/* [HGM] learn: results learned in MC mode are appended to a journal next to the book (<book>.lrn),
+ * as book entries with the increments of the learn counters and the number of games as weight.
+ * At startup the memory book is filled by replaying the journal, so the book file itself only
+ * changes when the user saves one. When the journal grows large, it is renamed to <book>.lrn.old,
+ * and a background thread adds it to the summed journal <book>.lrn.sum, which holds a single
+ * record with the total counts for every learned move.
+ */
+
+#define JOURNAL_BUF 1024 /* records buffered before writing */
+
+static unsigned char journal[16*JOURNAL_BUF];
+static int journalLen, learning;
+
+typedef struct {
+    char sum[MSG_SIZ], old[MSG_SIZ], tmp[MSG_SIZ];
+} Compaction;
+
+static Compaction compaction;
+static int compacting;
+static volatile int compactDone;
+#if USE_THREADS
+static pthread_t compactor;
+#endif
+
+static void
+FlushJournal ()
+{   // append the buffered records to the journal
+    char name[MSG_SIZ];
+    FILE *f;
+    if(!journalLen) return;
+    snprintf(name, MSG_SIZ, "%s.lrn", appData.polyglotBook);
+    if((f = fopen(name, "ab"))) {
+	if(fwrite(journal, 16, journalLen, f) != journalLen && appData.debugMode) fprintf(debugFP, "could not write %s\n", name);
+	fclose(f);
+    }
+    journalLen = 0;
+}
+
+static void
+Journal (entry_t *e)
+{   // record a learned result, as the increments of the learn counters, and a weight of one game
+    entry_to_bytes(journal + 16*journalLen++, e);
+    if(journalLen == JOURNAL_BUF) FlushJournal();
+}
+
+static int
+ReplayJournal (char *name)
+{   // add the counts recorded in a journal to the memory book; return the number of records
+    unsigned char buf[16*1024];
+    FILE *f = fopen(name, "rb");
+    entry_t e;
+    int n, i, count = 0;
+    if(!f) return 0;
+    while((n = fread(buf, 16, 1024, f)) > 0) for(i=0; i<n; i++, count++) {
+	entry_from_bytes(buf + 16*i, &e);
+	LearnMove(&e);
+    }
+    fclose(f);
+    return count;
+}
+
+static void
+ReadMemBook ()
+{   // count what earlier sessions learned in the memory book
+    char name[MSG_SIZ];
+    int count;
+    if(!*appData.polyglotBook) return;
+    snprintf(name, MSG_SIZ, "%s.lrn.sum", appData.polyglotBook);
+    count = ReplayJournal(name);
+    snprintf(name, MSG_SIZ, "%s.lrn.old", appData.polyglotBook); // left by an interrupted compaction
+    count += ReplayJournal(name);
+    snprintf(name, MSG_SIZ, "%s.lrn", appData.polyglotBook);
+    count += ReplayJournal(name);
+    if(appData.debugMode) fprintf(debugFP, "%d learn records replayed\n", count);
+}
+
+static long
+FileSize (char *name)
+{
+    FILE *f = fopen(name, "rb");
+    long size = -1;
+    if(f) fseek(f, 0, SEEK_END), size = ftell(f), fclose(f);
+    return size;
+}
+
+static int
+CompareEntries (const void *a, const void *b)
+{
+    const entry_t *e1 = a, *e2 = b;
+    if(e1->key != e2->key) return e1->key < e2->key ? -1 : 1;
+    return (int) e1->move - (int) e2->move;
+}
+
+static int
+ReadEntry (FILE *f, entry_t *e)
+{
+    unsigned char buf[16];
+    if(!f || fread(buf, 16, 1, f) != 1) return FALSE;
+    entry_from_bytes(buf, e);
+    return TRUE;
+}
+
+static void
+WriteEntry (FILE *f, entry_t *e)
+{
+    unsigned char buf[16];
+    entry_to_bytes(buf, e);
+    fwrite(buf, 16, 1, f);
+}
+
+static int
+ReplaceFile (char *tmp, char *name)
+{   // rename tmp to name; where rename does not replace (Windows) the old file is moved aside, and only removed after that
+    char bak[MSG_SIZ];
+    if(!rename(tmp, name)) return TRUE;
+    snprintf(bak, MSG_SIZ, "%s.bak", name);
+    remove(bak);
+    if(rename(name, bak)) return FALSE;
+    if(rename(tmp, name)) { rename(bak, name); return FALSE; }
+    remove(bak);
+    return TRUE;
+}
+
+static int
+ReadEntries (char *name, entry_t *e, int max)
+{   // append up to max entries from a file; return their number
+    FILE *f = fopen(name, "rb");
+    int n = 0;
+    while(n < max && ReadEntry(f, e + n)) n++;
+    if(f) fclose(f);
+    return n;
+}
+
+static void *
+CompactBook (void *arg)
+{   // add the journal c->old to the summed journal c->sum, through temporary file c->tmp
+    Compaction *c = (Compaction *) arg;
+    entry_t *delta;
+    FILE *out;
+    long size = FileSize(c->old), sumSize = FileSize(c->sum);
+    int n = 0, i, k, ok = FALSE;
+
+    if(sumSize < 0) sumSize = 0; // need not exist yet
+    if(size >= 0 && (delta = (entry_t *) malloc(((size + sumSize)/16 + 1) * sizeof(entry_t)))) {
+	n = ReadEntries(c->sum, delta, sumSize/16);
+	n += ReadEntries(c->old, delta + n, size/16);
+	qsort(delta, n, sizeof(entry_t), CompareEntries);
+	for(i=k=0; i<n; i++) { // combine the records for the same move
+	    if(k && !CompareEntries(delta + k - 1, delta + i)) AddLearned(delta + k - 1, delta + i);
+	    else delta[k++] = delta[i];
+	}
+	if((out = fopen(c->tmp, "wb"))) {
+	    for(i=0; i<k; i++) WriteEntry(out, delta + i);
+	    ok = !ferror(out) & !fclose(out);
+	}
+	free(delta);
+    }
+    if(ok && ReplaceFile(c->tmp, c->sum)) remove(c->old); // otherwise the journal will be replayed, and summed next time
+    else remove(c->tmp);
+    compactDone = TRUE;
+    return NULL;
+}
+
+static int
+CompactionBusy (int wait)
+{   // reap the background compaction when it finished (or wait for that); return whether it is still running
+#if USE_THREADS
+    if(compacting && (wait || compactDone)) pthread_join(compactor, NULL), compacting = FALSE;
+#endif
+    return compacting;
+}
+
+static void
+StartCompaction ()
+{   // sum the journal when it has grown large
+    Compaction *c = &compaction;
+    char name[MSG_SIZ];
+    long size;
+    if(CompactionBusy(FALSE)) return;
+    snprintf(c->sum, MSG_SIZ, "%s.lrn.sum", appData.polyglotBook);
+    snprintf(c->old, MSG_SIZ, "%s.lrn.old", appData.polyglotBook);
+    snprintf(c->tmp, MSG_SIZ, "%s.lrn.tmp", appData.polyglotBook);
+    if(FileSize(c->old) < 0) { // no journal left by interrupted compaction, so take the current one
+	snprintf(name, MSG_SIZ, "%s.lrn", appData.polyglotBook);
+	size = FileSize(name);
+	if(size < (1<<20) || size < FileSize(c->sum) >> 4) return; // not worth it yet
+	if(rename(name, c->old)) return;
+    }
+    compactDone = FALSE;
+#if USE_THREADS
+    if(!pthread_create(&compactor, NULL, CompactBook, c)) { compacting = TRUE; return; }
+#endif
+    CompactBook(c);
+}
+
+void
+AddToBook (int moveNr, int result)
+{
+    int move;
+    uint64 key;
+    entry_t entry;
+
+    if(!moveList[moveNr][0] || moveList[moveNr][0] == '\n') return; // could be terminal position
+
+    if(appData.debugMode) fprintf(debugFP, "add move %d to book %s", moveNr, moveList[moveNr]);
+
+    // calculate key and book representation of move
+    key = hash(moveNr);
+    move = ListMove(moveNr);
+    NewEntry(&entry, key, move, result);
+
+    if(learning) Journal(&entry);
+    LearnMove(&entry);
+}
+
 void
 AddGameToBook (int always)
 {
@@ -1020,8 +1667,11 @@ AddGameToBook (int always)
     }
 
     if(appData.debugMode) fprintf(debugFP, "add game to book (%d-%d)\n", backwardMostMove, forwardMostMove);
+    learning = !always && *appData.polyglotBook; // [HGM] learn: persist what is learned in MC mode
     for(i=backwardMostMove; i<forwardMostMove && i < 2*appData.bookDepth; i++)
 	AddToBook(i, WhiteOnMove(i) ? result : 2-result); // flip result when black moves
+    if(learning) FlushJournal(), StartCompaction();
+    learning = FALSE;
 }
 
 void
@@ -1037,19 +1687,415 @@ PlayBookMove(char *text, int index)
 void
 FlushBook ()
 {
+    unsigned char buf[16*1024];
+    char tmp[MSG_SIZ];
     FILE *f;
-    int i;
+    int i, n;
 
     InitMemBook();
     Merge(); // flush merge buffer to memBook
 
-    if(f = fopen(appData.polyglotBook, "wb")) {
-	for(i=0; i<bookSize; i++) {
-	    entry_t entry = memBook[i];
-	    entry.weight = entry.learnPoints;
-//	    entry.learnPoints = 0;
-//	    entry.learnCount  = 0;
-	    entry_to_file(f, &entry);
+    // write a new file and rename it, rather than truncating the book others may have mapped in memory
+    snprintf(tmp, MSG_SIZ, "%s.tmp", appData.polyglotBook);
+    if(f = fopen(tmp, "wb")) {
+	for(i=0; i<bookSize-1; i+=n) { // last entry is end marker
+	    for(n=0; n<1024 && i+n<bookSize-1; n++) {
+		entry_t entry = memBook[i+n];
+		entry.weight = entry.learnPoints;
+		entry_to_bytes(buf + 16*n, &entry);
+	    }
+	    fwrite(buf, 16, n, f);
 	}
+	if(fclose(f) || !ReplaceFile(tmp, appData.polyglotBook)) remove(tmp), DisplayError(_("Could not create book"), 0);
+	dirty = 1;
     } else DisplayError(_("Could not create book"), 0);
 }
+
+/* [HGM] book building: the games of the list are replayed by several threads, which each collect
+ * (key, move, result) tuples in a run buffer. A full buffer is sorted, tuples for the same move are
+ * combined, and it is written as a run to a temporary file. Merging all runs then produces the book,
+ * so that its size is not limited by memory. Games that are not packed are parsed afterwards.
+ */
+
+#define RUN_SIZE (1<<20) /* tuples per run */
+
+typedef struct {
+    uint64 key;
+    unsigned int move, points, count; // counts as in CountMove, but without 16-bit limit
+    unsigned int games;               // when compacting a book: the weight
+} tuple_t;
+
+typedef struct {
+    FILE *f;   // temporary file with the runs of one thread
+    long pos;
+    int len;
+} Run;
+
+typedef struct {
+    tuple_t *buf;
+    int n;
+    FILE *f;
+} RunWriter;
+
+typedef struct {
+    ListGame **games;
+    int nr, next, depth;
+    ListGame **rest;  // games the threads left for parsing
+    int nrRest;
+    Run *runs;
+    int nrRuns, maxRuns, error;
+    int prune;       // when compacting a book: the weight below which entries are dropped, else -1
+    FILE *files[65]; // temporary files holding the runs, one per thread
+    int nrFiles;
+    signed char castlingRank[BOARD_FILES]; // seeds for the thread-local copies
+    unsigned char initialRights[BOARD_FILES];
+#if USE_THREADS
+    pthread_mutex_t lock;
+#endif
+} BookJob;
+
+static void
+Lock (BookJob *job)
+{
+#if USE_THREADS
+    pthread_mutex_lock(&job->lock);
+#endif
+}
+
+static void
+Unlock (BookJob *job)
+{
+#if USE_THREADS
+    pthread_mutex_unlock(&job->lock);
+#endif
+}
+
+static int
+CompareTuples (const void *a, const void *b)
+{
+    const tuple_t *t1 = a, *t2 = b;
+    if(t1->key != t2->key) return t1->key < t2->key ? -1 : 1;
+    return (int) t1->move - (int) t2->move;
+}
+
+static void
+FlushRun (BookJob *job, RunWriter *w)
+{   // sort the run buffer, combine equal moves, and append it as a run to the thread's file
+    int i, n = 0;
+    Run run;
+    if(!w->n) return;
+    qsort(w->buf, w->n, sizeof(tuple_t), CompareTuples);
+    for(i=1; i<w->n; i++) {
+	if(w->buf[i].key == w->buf[n].key && w->buf[i].move == w->buf[n].move)
+	    w->buf[n].points += w->buf[i].points, w->buf[n].count += w->buf[i].count, w->buf[n].games += w->buf[i].games;
+	else w->buf[++n] = w->buf[i];
+    }
+    n++; w->n = 0;
+    if(!w->f) {
+	Lock(job);
+	if(job->nrFiles < 65 && (w->f = tmpfile())) job->files[job->nrFiles++] = w->f;
+	Unlock(job);
+	if(!w->f) { job->error = TRUE; return; }
+    }
+    run.f = w->f; run.pos = ftell(w->f); run.len = n;
+    if(fwrite(w->buf, sizeof(tuple_t), n, w->f) != n) { job->error = TRUE; return; }
+    Lock(job);
+    if(job->nrRuns >= job->maxRuns) {
+	Run *p = realloc(job->runs, (job->maxRuns = 2*job->maxRuns + 64) * sizeof(Run));
+	if(p) job->runs = p; else job->error = TRUE;
+    }
+    if(!job->error) job->runs[job->nrRuns++] = run;
+    Unlock(job);
+}
+
+static void
+AddTuple (BookJob *job, RunWriter *w, uint64 key, int move, int result)
+{
+    tuple_t *t;
+    if(w->n >= RUN_SIZE) FlushRun(job, w);
+    t = w->buf + w->n++;
+    t->key = key; t->move = move;
+    t->points = (result > 0); t->count = (result < 2); // a draw counts as win + loss
+    t->games = 1;
+}
+
+static int
+GameResult (ChessMove result)
+{   // result from the viewpoint of white in CountMove encoding, -1 if unknown
+    switch(result) {
+      case GameIsDrawn: return 1;
+      case WhiteWins:   return 2;
+      case BlackWins:   return 0;
+      default: return -1;
+    }
+}
+
+static void *
+BookWorker (void *arg)
+{
+    BookJob *job = (BookJob *) arg;
+    RunWriter w;
+    signed char (*moves)[5];
+    Board board, start;
+    int i, first, ply, n, result;
+
+    memcpy(castlingRank, job->castlingRank, sizeof(castlingRank)); // ApplyMove needs these
+    memcpy(initialRights, job->initialRights, sizeof(initialRights));
+    w.buf = (tuple_t *) malloc(RUN_SIZE * sizeof(tuple_t)); w.n = 0; w.f = NULL;
+    moves = malloc(job->depth * sizeof(*moves) + 1);
+    if(!w.buf || !moves) { free(w.buf); free(moves); return NULL; } // other threads will take our share
+    CopyBoard(start, initialPosition);
+    start[KEY_STATE] = EmptySquare; PlacementKey(start); // seed the key once, so ApplyMove can keep it up to date
+    while(!job->error) {
+	Lock(job);
+	first = job->next; job->next += 256;
+	Unlock(job);
+	if(first >= job->nr) break;
+	for(i=first; i<first+256 && i<job->nr; i++) {
+	    ListGame *lg = job->games[i];
+	    if((result = GameResult(lg->gameInfo.result)) < 0) continue;
+	    if(lg->gameInfo.variant != gameInfo.variant || (n = UnpackGame(lg, job->depth, moves)) < 0) {
+		Lock(job); job->rest[job->nrRest++] = lg; Unlock(job); // must be parsed from the file
+		continue;
+	    }
+	    CopyBoard(board, start);
+	    for(ply=0; ply<n; ply++) {
+		signed char *m = moves[ply];
+		AddTuple(job, &w, BoardKey(board, WhiteOnMove(ply)),
+			 CoordsToMove(m[0], m[1], m[2], m[3], m[4]), WhiteOnMove(ply) ? result : 2 - result);
+		ApplyMove(m[0], m[1], m[2], m[3], m[4], board);
+	    }
+	}
+    }
+    FlushRun(job, &w); // the run file stays open for merging
+    free(w.buf); free(moves);
+    FreeLegalMoves();
+    return NULL;
+}
+
+typedef struct {
+    Run run;
+    tuple_t buf[1024];
+    int n, i;
+} RunReader;
+
+static tuple_t *
+RunHead (RunReader *r)
+{   // next tuple of the run, NULL when it is exhausted
+    if(r->i >= r->n) {
+	int n = r->run.len < 1024 ? r->run.len : 1024;
+	if(n <= 0 || fseek(r->run.f, r->run.pos, SEEK_SET) || fread(r->buf, sizeof(tuple_t), n, r->run.f) != n) return NULL;
+	r->run.pos += n * sizeof(tuple_t); r->run.len -= n;
+	r->n = n; r->i = 0;
+    }
+    return r->buf + r->i;
+}
+
+static int
+WritePosition (FILE *f, tuple_t *moves, int n)
+{   // write the book entries of one position; return number written.
+    // Like the memory book, positions that occurred only once are left out.
+    unsigned char buf[16*MOVE_BUF];
+    unsigned int i, games = 0, max = 0;
+    double scale = 1.;
+    entry_t e;
+    for(i=0; i<n; i++) {
+	games += moves[i].games;
+	if(moves[i].points > max) max = moves[i].points;
+	if(moves[i].count  > max) max = moves[i].count;
+    }
+    if(games < 2) return 0;
+    if(max > 0xFFFF) scale = 65535. / max; // counts only matter relative to each other
+    for(i=0; i<n; i++) {
+	e.key = moves[i].key; e.move = moves[i].move;
+	e.weight = e.learnPoints = moves[i].points * scale;
+	e.learnCount = moves[i].count * scale;
+	entry_to_bytes(buf + 16*i, &e);
+    }
+    return fwrite(buf, 16, n, f) == n ? n : -1;
+}
+
+static int
+WriteCompacted (FILE *f, tuple_t *moves, int n, int prune)
+{   // write the merged entries of one position, minus those that weigh too little
+    unsigned char buf[16*MOVE_BUF];
+    int i, m = 0;
+    entry_t e;
+    for(i=0; i<n; i++) {
+	if(moves[i].games < prune) continue;
+	e.key = moves[i].key; e.move = moves[i].move;
+	e.weight      = moves[i].games  > 0xFFFF ? 0xFFFF : moves[i].games;
+	e.learnPoints = moves[i].points > 0xFFFF ? 0xFFFF : moves[i].points;
+	e.learnCount  = moves[i].count  > 0xFFFF ? 0xFFFF : moves[i].count;
+	entry_to_bytes(buf + 16*m++, &e);
+    }
+    return fwrite(buf, 16, m, f) == m ? m : -1;
+}
+
+static int
+WriteMoves (BookJob *job, FILE *f, tuple_t *moves, int n)
+{
+    return job->prune < 0 ? WritePosition(f, moves, n) : WriteCompacted(f, moves, n, job->prune);
+}
+
+static int
+MergeRuns (BookJob *job, FILE *f)
+{   // k-way merge of all runs, writing the book entries; return number of entries, or -1 on error
+    RunReader **heap, *r;
+    tuple_t moves[MOVE_BUF], *t;
+    int i, k = 0, n = 0, written = 0, c;
+
+    heap = (RunReader **) malloc((job->nrRuns + 1) * sizeof(RunReader *));
+    if(!heap) return -1;
+    for(i=0; i<job->nrRuns; i++) { // fill the heap with the non-empty runs
+	int j;
+	if(!(r = (RunReader *) malloc(sizeof(RunReader)))) { written = -1; break; }
+	r->run = job->runs[i]; r->n = r->i = 0;
+	if(!RunHead(r)) { free(r); continue; }
+	for(j=k++; j > 0 && CompareTuples(RunHead(heap[(j-1)/2]), RunHead(r)) > 0; j = (j-1)/2) heap[j] = heap[(j-1)/2];
+	heap[j] = r;
+    }
+    while(k > 0 && written >= 0) {
+	t = RunHead(heap[0]);
+	if(n && t->key == moves[n-1].key && t->move == moves[n-1].move) { // same move as previous: combine
+	    moves[n-1].points += t->points; moves[n-1].count += t->count; moves[n-1].games += t->games;
+	} else {
+	    if(n && (t->key != moves[0].key || n == MOVE_BUF)) { // new position
+		if((c = WriteMoves(job, f, moves, n)) < 0) written = -1; else written += c;
+		n = 0;
+	    }
+	    moves[n++] = *t;
+	}
+	r = heap[0]; r->i++;
+	if(!RunHead(r)) { free(r); r = heap[--k]; } // run exhausted; replace by last heap element
+	for(i=0; 2*i+1 < k; ) { // sift down
+	    int child = 2*i+1;
+	    if(child+1 < k && CompareTuples(RunHead(heap[child+1]), RunHead(heap[child])) < 0) child++;
+	    if(CompareTuples(RunHead(heap[child]), RunHead(r)) >= 0) break;
+	    heap[i] = heap[child]; i = child;
+	}
+	if(k > 0) heap[i] = r;
+    }
+    if(n && written >= 0) { if((c = WriteMoves(job, f, moves, n)) < 0) written = -1; else written += c; }
+    while(k > 0) free(heap[--k]);
+    free(heap);
+    return written;
+}
+
+int
+BuildBook (FILE *f)
+{   // [HGM] book: create a book from the selected games of the list in open file f; return number of entries, or -1
+    BookJob job;
+    RunWriter w;
+    ListGame *lg;
+    FILE *book;
+    int i, ply, result, n = 0, threads = 1, count = -1;
+    int nr = ((ListGame *) gameList.tailPred)->number;
+    char buf[MSG_SIZ], tmp[MSG_SIZ];
+
+    memset(&job, 0, sizeof(job));
+#if USE_THREADS
+    pthread_mutex_init(&job.lock, NULL);
+#endif
+    job.depth = 2*appData.bookDepth;
+    job.prune = -1;
+    job.games = (ListGame **) malloc((nr + 1) * sizeof(ListGame *));
+    job.rest  = (ListGame **) malloc((nr + 1) * sizeof(ListGame *));
+    w.buf = (tuple_t *) malloc(RUN_SIZE * sizeof(tuple_t)); w.n = 0; w.f = NULL;
+    if(!job.games || !job.rest || !w.buf) goto done;
+    for(lg = (ListGame *) gameList.head; lg->node.succ; lg = (ListGame *) lg->node.succ)
+	if(lg->position >= 0) job.games[n++] = lg;
+    job.nr = n;
+    memcpy(job.castlingRank, castlingRank, sizeof(castlingRank));
+    memcpy(job.initialRights, initialRights, sizeof(initialRights));
+    DisplayTitle(_("Building book")); DoEvents();
+#if USE_THREADS
+    {
+	pthread_t tid[64];
+# ifdef _SC_NPROCESSORS_ONLN
+	if(n > 1024) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > 64) threads = 64;
+# endif
+	for(i=1; i<threads; i++) if(pthread_create(&tid[i], NULL, BookWorker, &job)) break;
+	threads = i;
+	BookWorker(&job); // main thread participates
+	for(i=1; i<threads; i++) pthread_join(tid[i], NULL);
+    }
+#else
+    BookWorker(&job);
+#endif
+    if(job.next < n) job.error = TRUE; // no thread could get memory
+    for(i=0; i<job.nrRest && !job.error; i++) { // parse the others serially, as the parser cannot be shared
+	lg = job.rest[i];
+	if(LoadGame(f, lg->number, "", TRUE) && (result = GameResult(gameInfo.result)) >= 0)
+	    for(ply=backwardMostMove; ply<forwardMostMove && ply<job.depth; ply++)
+		if(moveList[ply][0] && moveList[ply][0] != '\n')
+		    AddTuple(&job, &w, hash(ply), ListMove(ply), WhiteOnMove(ply) ? result : 2 - result);
+	if(i % 1000 == 0) {
+	    snprintf(buf, MSG_SIZ, _("Building book (%d)"), lg->number);
+	    DisplayTitle(buf); DoEvents();
+	}
+    }
+    FlushRun(&job, &w);
+    if(job.error) goto done;
+    snprintf(tmp, MSG_SIZ, "%s.tmp", appData.polyglotBook); // replace the book as a whole, as others may have it mapped
+    if(!(book = fopen(tmp, "wb"))) { DisplayError(_("Could not create book"), 0); goto done; }
+    count = MergeRuns(&job, book);
+    if(fclose(book) || count < 0 || !ReplaceFile(tmp, appData.polyglotBook))
+	count = -1, remove(tmp), DisplayError(_("Could not create book"), 0);
+    dirty = 1;
+    if(appData.debugMode) fprintf(debugFP, "book of %d entries from %d games (%d parsed, %d runs, %d threads)\n",
+				  count, n, job.nrRest, job.nrRuns, threads);
+  done:
+    for(i=0; i<job.nrFiles; i++) fclose(job.files[i]); // which deletes them
+#if USE_THREADS
+    pthread_mutex_destroy(&job.lock);
+#endif
+    free(job.runs); free(job.games); free(job.rest); free(w.buf);
+    return count;
+}
+
+int
+CompactBookFile (char *name, int minWeight, int *before)
+{   // [HGM] compact: rewrite a book with its entries sorted, duplicate moves merged, and the moves
+    // that weigh less than minWeight left out; return the number of entries kept, or -1.
+    // The book is sorted through runs like when building one, so it need not fit in memory.
+    BookJob job;
+    RunWriter w;
+    entry_t e;
+    char tmp[MSG_SIZ];
+    FILE *f, *book = NULL;
+    int i, count = -1;
+
+    memset(&job, 0, sizeof(job));
+#if USE_THREADS
+    pthread_mutex_init(&job.lock, NULL);
+#endif
+    job.prune = minWeight < 0 ? 0 : minWeight; // a negative prune means building, where weights are calculated
+    *before = 0;
+    w.buf = (tuple_t *) malloc(RUN_SIZE * sizeof(tuple_t)); w.n = 0; w.f = NULL;
+    if(!w.buf || !(f = fopen(name, "rb"))) goto done;
+    while(ReadEntry(f, &e) && !job.error) {
+	tuple_t *t;
+	(*before)++;
+	if(e.key == ~(uint64)0) continue; // end marker of a memory book
+	if(w.n >= RUN_SIZE) FlushRun(&job, &w);
+	t = w.buf + w.n++;
+	t->key = e.key; t->move = e.move;
+	t->points = e.learnPoints; t->count = e.learnCount; t->games = e.weight;
+    }
+    fclose(f);
+    FlushRun(&job, &w);
+    if(job.error) goto done;
+    snprintf(tmp, MSG_SIZ, "%s.tmp", name);
+    if(!(book = fopen(tmp, "wb"))) goto done;
+    count = MergeRuns(&job, book);
+    if(fclose(book) || count < 0 || !ReplaceFile(tmp, name)) count = -1, remove(tmp);
+  done:
+    for(i=0; i<job.nrFiles; i++) fclose(job.files[i]);
+#if USE_THREADS
+    pthread_mutex_destroy(&job.lock);
+#endif
+    free(job.runs); free(w.buf);
+    return count;
+}
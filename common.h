@@ -153,6 +153,19 @@ typedef char *String;
        #define s64Const(c) (c ## ll)
 #endif
 
+/* [HGM] threads: scratch variables of parser and move generator must be private to each thread that parses games,
+   so threads are only used (USE_THREADS) where the compiler can make them so */
+#if HAVE_PTHREAD_H && defined(__GNUC__)
+# define THREAD_LOCAL __thread
+# define USE_THREADS 1
+#elif HAVE_PTHREAD_H && defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+# define THREAD_LOCAL _Thread_local
+# define USE_THREADS 1
+#else
+# define THREAD_LOCAL
+# define USE_THREADS 0
+#endif
+
 #define PROTOVER                2       /* engine protocol version */
 
 // [HGM] license: Messages that engines must print to satisfy their license requirements for patented variants
@@ -181,6 +194,10 @@ typedef char *String;
 #define BOARD_RGHT   (gameInfo.boardWidth + gameInfo.holdingsWidth)
 #define CASTLING     (BOARD_RANKS-1)           /* [HGM] hide in upper rank   */
 #define VIRGIN       (BOARD_RANKS-2)           /* [HGM] pieces not moved     */
+#define KEY_LOW      CASTLING][(BOARD_FILES-9) /* [HGM] hash: Zobrist key of */
+#define KEY_HIGH     CASTLING][(BOARD_FILES-8) /* piece placement, updated   */
+#define KEY_STATE    CASTLING][(BOARD_FILES-7) /* by ApplyMove when KEY_SET  */
+#define KEY_SET      0x4B4559                  /* [HGM] marks valid key      */
 #define TOUCHED_W    CASTLING][(BOARD_FILES-6) /* [HGM] in upper rank        */
 #define TOUCHED_B    CASTLING][(BOARD_FILES-5) /* [HGM] in upper rank        */
 #define EP_RANK      CASTLING][(BOARD_FILES-4) /* [HGM] in upper rank        */
@@ -695,6 +712,7 @@ typedef struct {
     Boolean usePolyglotBook;
     Boolean defNoBook;
     char * polyglotBook;
+    char * bookCascade; /* [HGM] extra books, probed in order after a miss */
     int bookDepth;
     int bookStrength;
     int defaultHashSize;
@@ -765,6 +783,7 @@ typedef struct {
     int maxPieces;
     Boolean ignoreColors;
     Boolean findMirror;
+    Boolean positionIndex;
     char *userName;
     int rewindIndex;    /* [HGM] autoinc   */
     int sameColorGames; /* [HGM] alternate */
@@ -27,6 +27,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #if STDC_HEADERS
 # include <stdlib.h>
@@ -38,6 +39,14 @@
 #  include <strings.h>
 # endif /* not HAVE_STRING_H */
 #endif /* not STDC_HEADERS */
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 #include "common.h"
 #include "frontend.h"
@@ -59,15 +68,76 @@
  */
 List gameList;
 extern Board initialPosition;
-extern int quickFlag;
-extern int movePtr;
 
 /* Local function prototypes
  */
 static void GameListDeleteGame P((ListGame *));
 static ListGame *GameListCreate P((void));
 static void GameListFree P((List *));
-static int GameListNewGame P((ListGame **));
+static int GameListNewGame P((List *, ListGame **));
+static int OpenPositionIndex P((FILE *f, char *name));
+static void WritePositionIndex P((int keep));
+
+/* [HGM] position index: a sidecar file <gamefile>.pos holding the sorted (key, game) pairs of
+ * all positions in the game file, so that exact-position searches need not replay every game.
+ * It is only trusted as long as size and modification time of the game file did not change.
+ */
+#define INDEX_VERSION 1
+
+typedef struct {
+    char magic[4];
+    int version, variant, width, height;
+    s64 size, mtime, count;
+} IndexHeader;
+
+typedef struct {
+    u64 key;
+    int game;
+} IndexEntry;
+
+static FILE *posIndex;           // open index file of the current game list, if any
+static IndexHeader indexHeader;
+static IndexEntry *indexBuf;     // entries collected while building the list
+static int indexNr, indexSize;
+static char indexName[MSG_SIZ], *indexHits;
+static int hitsSize;
+
+/* [HGM] refresh: a game file that was only appended to (e.g. by a running tournament) does not have to be
+ * parsed again from the start. We remember which file the list was built from, its size and modification
+ * time, and its last bytes, to recognize the old contents. Only the last game, which could have been
+ * incomplete, and what follows it is then parsed, and the new games are added to the existing list.
+ */
+#define TAIL_SIZE 256
+
+typedef struct {
+    char name[MSG_SIZ];
+    struct stat st;
+    int variant, width, height, legality, tailLen;
+    char tail[TAIL_SIZE]; // last bytes of the file
+} ListSource;
+
+static ListSource listSource, newSource;
+
+/* [HGM] parallel build: large mapped game files are cut into parts just before an Event tag, and each part
+ * is parsed by its own thread into a private game list, move-arena chunks and index entries. The parts are
+ * concatenated afterwards, provided each part stopped exactly at the game where the next one started.
+ */
+#define MAX_PARTS 64
+#define MIN_PART  0x400000 // bytes per thread below which parallel parsing does not pay
+
+typedef struct {
+    List games;                   // games found in this part, numbered from 1
+    IndexEntry *index;            // their position-index entries
+    int indexNr, indexSize, error;
+    Board board, tagBoard;        // private boards the parser works on, for the moves and between tags
+    long start, end;              // parse from start; a game whose first token ends beyond end is for the next part
+    long stop, stopEnd, firstEnd; // offset and token end of the game that made us stop, and token end of our first game
+    Boolean indexing, threaded;
+    signed char castlingRank[BOARD_FILES]; // seeds for the thread-local copies
+    unsigned char initialRights[BOARD_FILES];
+} BuildPart;
+
+static void IndexPosition P((BuildPart *part, Board board, int whiteToMove, int game));
 
 /* [AS] Wildcard pattern matching */
 Boolean
@@ -127,6 +197,259 @@ SearchPattern (const char * text, const char * pattern)
     return result;
 }
 
+/* [HGM] tag index: the tags most used for filtering are kept in per-game columns, with strings interned
+ * in a dictionary. A filter consisting of terms like White=Stockfish Result=1-0 Elo>3000 is then evaluated
+ * from these columns: string conditions are evaluated once per distinct string, into a bitset that the
+ * games then only have to look up. Strings match as in the text filter (substring, with wildcards).
+ */
+#define MAX_TERMS 16
+
+enum { TAG_WHITE, TAG_BLACK, TAG_EVENT, TAG_SITE, TAG_ECO, NR_STRING_TAGS, TAG_PLAYER = NR_STRING_TAGS,
+       TAG_RESULT, TAG_DATE, TAG_WHITE_ELO, TAG_BLACK_ELO, TAG_ELO };
+
+static char *tagNames[] = { "White", "Black", "Event", "Site", "ECO", "Player", "Result", "Date", "WhiteElo", "BlackElo", "Elo", NULL };
+
+typedef struct {
+    int tag, op, negate;
+    int lo, hi;          // range of numeric values that satisfies it
+    unsigned char *bits; // for string tags, which dictionary entries satisfy it
+} TagTerm;
+
+static int *tagColumn[NR_STRING_TAGS], *dateColumn, *eloColumn[2];
+static unsigned char *resultColumn;
+static int tagRows, tagRowsSize;
+static char **dict;      // interned strings; entry 0 stands for an absent tag
+static int dictNr, dictSize, *dictHash, hashSize;
+static TagTerm terms[MAX_TERMS];
+static int nrTerms;
+
+static void
+TagIndexClear ()
+{
+    int i;
+    for(i=1; i<dictNr; i++) free(dict[i]);
+    dictNr = tagRows = 0;
+    if(dictHash) memset(dictHash, 0, hashSize * sizeof(int));
+}
+
+static unsigned int
+HashString (char *s)
+{
+    unsigned int h = 2166136261u;
+    while(*s) h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static int
+Intern (char *s)
+{   // dictionary id of the string, adding it when new; -1 when out of memory
+    unsigned int h;
+    int i;
+    if(!s || !*s || !strcmp(s, "?")) return 0;
+    if(2*dictNr >= hashSize) { // grow hash table and rehash
+	int *p = (int *) calloc(hashSize ? 2*hashSize : 1024, sizeof(int));
+	if(!p) return -1;
+	free(dictHash); dictHash = p; hashSize = hashSize ? 2*hashSize : 1024;
+	for(i=1; i<dictNr; i++) {
+	    for(h = HashString(dict[i]) & (hashSize-1); dictHash[h]; h = (h+1) & (hashSize-1));
+	    dictHash[h] = i;
+	}
+    }
+    for(h = HashString(s) & (hashSize-1); (i = dictHash[h]); h = (h+1) & (hashSize-1))
+	if(!strcmp(dict[i], s)) return i;
+    if(dictNr >= dictSize) {
+	char **p = (char **) realloc(dict, (dictSize ? 2*dictSize : 1024) * sizeof(char *));
+	if(!p) return -1;
+	dict = p; dictSize = dictSize ? 2*dictSize : 1024;
+    }
+    if(!dictNr) dict[dictNr++] = "?";
+    if(!(dict[dictNr] = strdup(s))) return -1;
+    return dictHash[h] = dictNr++;
+}
+
+static char *
+ExtraTag (char *tags, char *name, char *buf, int size)
+{   // get value of a tag that is only stored in the extraTags string
+    int len = strlen(name);
+    char *p, *q;
+    for(p = tags; p && (p = strchr(p, '[')); p++)
+	if(!strncmp(p+1, name, len) && p[len+1] == ' ' && (p = strchr(p, '"')) && (q = strchr(++p, '"'))) {
+	    if(q - p >= size) q = p + size - 1;
+	    strncpy(buf, p, q - p); buf[q - p] = NULLCHAR;
+	    return buf;
+	}
+    return NULL;
+}
+
+static int
+DateValue (char *date, int fill)
+{   // date as yyyymmdd; unknown or omitted month and day are filled with given value
+    int i, n = 0, v;
+    for(i=0; i<3; i++) {
+	v = fill;
+	if(date && isdigit(date[0]) && isdigit(date[1])) {
+	    if(!i) { if(!isdigit(date[2]) || !isdigit(date[3])) return 0; v = atoi(date); date += 4; }
+	    else v = 10*(date[0] - '0') + date[1] - '0', date += 2;
+	    if(*date == '.') date++; else date = NULL;
+	} else if(!i) return 0; // unknown year
+	else date = NULL;
+	n = (i ? 100 : 1)*n + v;
+    }
+    return n;
+}
+
+static int
+ResultCode (ChessMove result)
+{
+    return result == WhiteWins ? 1 : result == BlackWins ? 2 : result == GameIsDrawn ? 3 : 0;
+}
+
+static void
+TagIndexUpdate ()
+{   // add columns for the games in the list that do not have them yet
+    ListGame *lg;
+    int i, n = ListEmpty(&gameList) ? 0 : ((ListGame *) gameList.tailPred)->number;
+    char buf[MSG_SIZ];
+    if(n > tagRowsSize) {
+	int size = n + n/4, *p[NR_STRING_TAGS + 3];
+	unsigned char *r;
+	for(i=0; i<NR_STRING_TAGS; i++) tagColumn[i] = (p[i] = (int *) realloc(tagColumn[i], size * sizeof(int))) ? p[i] : tagColumn[i];
+	dateColumn = (p[i] = (int *) realloc(dateColumn, size * sizeof(int))) ? p[i] : dateColumn; i++;
+	eloColumn[0] = (p[i] = (int *) realloc(eloColumn[0], size * sizeof(int))) ? p[i] : eloColumn[0]; i++;
+	eloColumn[1] = (p[i] = (int *) realloc(eloColumn[1], size * sizeof(int))) ? p[i] : eloColumn[1];
+	resultColumn = (r = (unsigned char *) realloc(resultColumn, size)) ? r : resultColumn;
+	for(i=0; i<NR_STRING_TAGS + 3; i++) if(!p[i]) r = NULL;
+	if(!r) { tagRows = tagRowsSize = 0; return; } // the columns that did grow are kept for a next try
+	tagRowsSize = size;
+    }
+    if(tagRows >= n) { tagRows = n; return; }
+    for(lg = (ListGame *) gameList.tailPred; lg->number > tagRows + 1; lg = (ListGame *) lg->node.pred);
+    for(; lg->node.succ; lg = (ListGame *) lg->node.succ) {
+	GameInfo *g = &lg->gameInfo;
+	i = lg->number - 1;
+	if((tagColumn[TAG_WHITE][i] = Intern(g->white)) < 0 || (tagColumn[TAG_BLACK][i] = Intern(g->black)) < 0 ||
+	   (tagColumn[TAG_EVENT][i] = Intern(g->event)) < 0 || (tagColumn[TAG_SITE][i] = Intern(g->site)) < 0 ||
+	   (tagColumn[TAG_ECO][i] = Intern(ExtraTag(g->extraTags, "ECO", buf, MSG_SIZ))) < 0) break;
+	dateColumn[i] = DateValue(g->date, 0);
+	eloColumn[0][i] = g->whiteRating; eloColumn[1][i] = g->blackRating;
+	resultColumn[i] = ResultCode(g->result);
+	tagRows = i + 1;
+    }
+}
+
+static char *
+ParseTerm (char *p, TagTerm *t)
+{   // parse Tag<op>Value from filter text; returns pointer behind it, or NULL if it is no such term
+    static char *ops[] = { "!=", "<=", ">=", "=", "<", ">", NULL };
+    char value[MSG_SIZ], *q = value;
+    int i, lo, hi, v;
+    while(isalpha(*p) && q < value + 20) *q++ = *p++;
+    *q = NULLCHAR; q = value;
+    for(t->tag = 0; tagNames[t->tag] && StrCaseCmp(value, tagNames[t->tag]); t->tag++);
+    if(!tagNames[t->tag]) return NULL;
+    for(t->op = 0; strncmp(p, ops[t->op], strlen(ops[t->op])); ) if(!ops[++t->op]) return NULL;
+    p += strlen(ops[t->op]);
+    if(*p == '"') { // quoted value can contain spaces
+	while(*++p && *p != '"' && q < value + MSG_SIZ - 1) *q++ = *p;
+	if(*p == '"') p++;
+    } else while(*p && *p != ' ' && *p != '\t' && q < value + MSG_SIZ - 1) *q++ = *p++;
+    *q = NULLCHAR;
+    t->negate = (t->op == 0); if(t->op == 0) t->op = 3; // != is negated =
+    t->bits = NULL;
+    if(t->tag < TAG_RESULT) { // string tag: evaluate for every dictionary entry
+	if(!(t->bits = (unsigned char *) calloc(dictNr/8 + 1, 1))) return NULL;
+	for(i=1; i<dictNr; i++) { // entry 0 (absent tag) never satisfies a term
+	    char *s = dict[i];
+	    int c = (t->op == 3 ? !SearchPattern(s, value) : strcmp(s, value));
+	    if(t->op == 1 ? c <= 0 : t->op == 2 ? c >= 0 : t->op == 3 ? c == 0 : t->op == 4 ? c < 0 : c > 0) t->bits[i>>3] |= 1 << (i & 7);
+	}
+	return p;
+    }
+    if(t->tag == TAG_RESULT) {
+	if(t->op != 3) return NULL;
+	for(i=0; i<4 && strcmp(value, PGNResult(i == 1 ? WhiteWins : i == 2 ? BlackWins : i == 3 ? GameIsDrawn : EndOfFile)); i++);
+	if(!strcmp(value, "1/2") || !strcmp(value, "=")) i = 3;
+	if(i == 4) return NULL;
+	t->lo = t->hi = i;
+	return p;
+    }
+    if(t->tag == TAG_DATE) lo = DateValue(value, 0), hi = DateValue(value, 99); // partial date is a range
+    else lo = hi = atoi(value);
+    if(lo <= 0 || !isdigit(value[0])) return NULL;
+    v = 0x7FFFFFFF;
+    switch(t->op) { // convert to range
+      case 1: t->lo = 1;    t->hi = hi;   break; // <=
+      case 2: t->lo = lo;   t->hi = v;    break; // >=
+      case 3: t->lo = lo;   t->hi = hi;   break; // =
+      case 4: t->lo = 1;    t->hi = lo-1; break; // <
+      case 5: t->lo = hi+1; t->hi = v;    break; // >
+    }
+    return p;
+}
+
+/* Set the filter for TagFilterMatch(); returns FALSE if the text does not consist of tag terms,
+ * so that it has to be used as a pattern that the game-list lines must contain.
+ */
+Boolean
+TagFilter (char *filter)
+{
+    char *p = filter;
+    while(nrTerms) free(terms[--nrTerms].bits);
+    TagIndexUpdate();
+    if(tagRows <= 0 || ListEmpty(&gameList) || tagRows < ((ListGame *) gameList.tailPred)->number) return FALSE;
+    while(*p) {
+	while(*p == ' ' || *p == '\t') p++;
+	if(!*p) break;
+	if(nrTerms >= MAX_TERMS || !(p = ParseTerm(p, terms + nrTerms))) break;
+	nrTerms++;
+    }
+    if(p && *p == NULLCHAR && nrTerms) return TRUE;
+    while(nrTerms) free(terms[--nrTerms].bits);
+    return FALSE;
+}
+
+Boolean
+TagFilterMatch (int number)
+{   // whether the game satisfies all terms of the filter; a game without the tag fails any term on it, != included
+    int i, n = number - 1, ok, v, w, present;
+    for(i=0; i<nrTerms; i++) {
+	TagTerm *t = terms + i;
+	switch(t->tag) {
+	  case TAG_PLAYER:
+	    v = tagColumn[TAG_WHITE][n]; w = tagColumn[TAG_BLACK][n];
+	    ok = (t->bits[v>>3] >> (v & 7) & 1) || (t->bits[w>>3] >> (w & 7) & 1);
+	    present = v || w;
+	    break;
+	  case TAG_RESULT:
+	    ok = (resultColumn[n] == t->lo);
+	    present = TRUE; // unknown result is "*"
+	    break;
+	  case TAG_DATE:
+	    v = dateColumn[n];
+	    ok = (v >= t->lo && v <= t->hi);
+	    present = v > 0;
+	    break;
+	  case TAG_WHITE_ELO:
+	  case TAG_BLACK_ELO:
+	    v = eloColumn[t->tag - TAG_WHITE_ELO][n];
+	    ok = (v >= t->lo && v <= t->hi);
+	    present = v > 0;
+	    break;
+	  case TAG_ELO: // both players
+	    v = eloColumn[0][n]; w = eloColumn[1][n];
+	    ok = (v >= t->lo && v <= t->hi && w >= t->lo && w <= t->hi);
+	    present = v > 0 && w > 0;
+	    break;
+	  default:
+	    v = tagColumn[t->tag][n];
+	    ok = t->bits[v>>3] >> (v & 7) & 1;
+	    present = v;
+	}
+	if(!present || ok == t->negate) return FALSE;
+    }
+    return TRUE;
+}
+
 /* Delete a ListGame; implies removint it from a list.
  */
 static void
@@ -206,54 +529,197 @@ GameListCreate ()
 /* Creates a new game for the gamelist.
  */
 static int
-GameListNewGame (ListGame **listGamePtr)
+GameListNewGame (List *list, ListGame **listGamePtr)
 {
     if (!(*listGamePtr = (ListGame *) GameListCreate())) {
-	GameListFree(&gameList);
+	GameListFree(list);
 	return(ENOMEM);
     }
-    ListAddTail(&gameList, (ListNode *) *listGamePtr);
+    ListAddTail(list, (ListNode *) *listGamePtr);
     return(0);
 }
 
 
-/* Build the list of games in the open file f.
- * Returns 0 for success or error number.
- */
+static void
+IndexPosition (BuildPart *part, Board board, int whiteToMove, int game)
+{
+    if(part->indexSize < 0) return;
+    if(part->indexNr >= part->indexSize) {
+	int size = part->indexSize ? 2*part->indexSize : 100000;
+	IndexEntry *p = (IndexEntry *) realloc(part->index, size * sizeof(IndexEntry));
+	if(!p) { free(part->index); part->index = NULL; part->indexSize = -1; return; } // out of memory; give up on index
+	part->index = p; part->indexSize = size;
+    }
+    part->index[part->indexNr].key = PositionKey(board, whiteToMove);
+    part->index[part->indexNr++].game = game;
+}
+
+static int
+OpenPositionIndex (FILE *f, char *name)
+{   // open the index belonging to game file, and return TRUE if it is still up to date
+    struct stat st;
+    IndexHeader h;
+    if(posIndex) fclose(posIndex);
+    posIndex = NULL; indexName[0] = NULLCHAR;
+    if(!name || fstat(fileno(f), &st)) return FALSE;
+    snprintf(indexName, MSG_SIZ, "%s.pos", name);
+    memset(&indexHeader, 0, sizeof(indexHeader));
+    memcpy(indexHeader.magic, "XBPI", 4); // no terminating zero
+    indexHeader.version = INDEX_VERSION;
+    indexHeader.variant = gameInfo.variant;
+    indexHeader.width = BOARD_WIDTH; indexHeader.height = BOARD_HEIGHT;
+    indexHeader.size = st.st_size; indexHeader.mtime = st.st_mtime;
+    if(!(posIndex = fopen(indexName, "rb"))) return FALSE;
+    if(fread(&h, sizeof(h), 1, posIndex) == 1 && h.count >= 0 && (indexHeader.count = h.count, !memcmp(&h, &indexHeader, sizeof(h))))
+	return TRUE;
+    fclose(posIndex); posIndex = NULL; // stale or corrupt; must be rebuilt
+    return FALSE;
+}
+
+static int
+CompareEntries (const void *a, const void *b)
+{
+    const IndexEntry *p = a, *q = b;
+    if(p->key != q->key) return p->key < q->key ? -1 : 1;
+    return p->game - q->game;
+}
+
+static int
+NextOldEntry (IndexEntry *e, s64 *left, int keep)
+{   // read the next entry of the open index file that belongs to one of the first keep-1 games
+    while(*left > 0) {
+	(*left)--;
+	if(fread(e, sizeof(IndexEntry), 1, posIndex) != 1) { *left = -1; return FALSE; }
+	if(e->game < keep) return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+WritePositionIndex (int keep)
+{   // sort the collected entries and write them to the index file; when keep is non-zero,
+    // merge them with the entries of games before number keep in the current index file
+    FILE *g;
+    IndexEntry e, *p;
+    int i, n = 0, ok = TRUE, old;
+    s64 left = keep && posIndex ? indexHeader.count : 0;
+    char tmpName[MSG_SIZ+1]; // indexName plus the ~
+    if(indexSize >= 0 && indexNr) {
+	qsort(indexBuf, indexNr, sizeof(IndexEntry), CompareEntries);
+	for(i=1; i<indexNr; i++) // remove repetitions of a position within the same game
+	    if(indexBuf[i].key != indexBuf[n].key || indexBuf[i].game != indexBuf[n].game) indexBuf[++n] = indexBuf[i];
+	n++;
+    }
+    snprintf(tmpName, MSG_SIZ+1, "%s~", indexName); // the old file must remain readable while merging
+    if(indexSize >= 0 && (n || left) && (g = fopen(tmpName, "wb"))) {
+	if(left && fseek(posIndex, sizeof(IndexHeader), SEEK_SET)) left = -1;
+	indexHeader.count = 0;
+	if(fwrite(&indexHeader, sizeof(IndexHeader), 1, g) != 1) ok = FALSE;
+	old = NextOldEntry(&e, &left, keep);
+	for(i=0; ok && (i < n || old); indexHeader.count++) {
+	    p = (i < n && (!old || CompareEntries(indexBuf + i, &e) < 0) ? indexBuf + i++ : &e);
+	    if(fwrite(p, sizeof(IndexEntry), 1, g) != 1) ok = FALSE;
+	    if(p == &e) old = NextOldEntry(&e, &left, keep);
+	}
+	if(left < 0 || fseek(g, 0, SEEK_SET) || fwrite(&indexHeader, sizeof(IndexHeader), 1, g) != 1) ok = FALSE;
+	if(fclose(g)) ok = FALSE;
+    } else ok = FALSE;
+    if(posIndex) fclose(posIndex), posIndex = NULL; // no longer describes the game file
+    remove(indexName); // rename() does not replace files everywhere
+    if(!ok) remove(tmpName); // incomplete files would fool us later
+    else if(!rename(tmpName, indexName)) posIndex = fopen(indexName, "rb");
+    free(indexBuf); indexBuf = NULL;
+    indexNr = indexSize = 0;
+}
+
+static int
+FindKey (u64 key)
+{   // binary search of the index file for the first entry with given key
+    IndexEntry e;
+    s64 lo = 0, hi = indexHeader.count;
+    while(lo < hi) {
+	s64 mid = (lo + hi) / 2;
+	if(fseek(posIndex, sizeof(IndexHeader) + mid*sizeof(IndexEntry), SEEK_SET) || fread(&e, sizeof(e), 1, posIndex) != 1) return -1;
+	if(e.key < key) lo = mid + 1; else hi = mid;
+    }
+    if(fseek(posIndex, sizeof(IndexHeader) + lo*sizeof(IndexEntry), SEEK_SET)) return -1;
+    return 0;
+}
+
+int
+PositionIndexSearch (u64 *keys, int n)
+{   // mark games containing any of the given positions; returns FALSE if there is no usable index
+    int i, nr;
+    IndexEntry e;
+    if(!posIndex || !gameList.head->succ) return FALSE;
+    nr = ((ListGame *) gameList.tailPred)->number + 1;
+    if(nr > hitsSize) {
+	char *p = (char *) realloc(indexHits, nr);
+	if(!p) return FALSE;
+	indexHits = p; hitsSize = nr;
+    }
+    memset(indexHits, 0, hitsSize);
+    for(i=0; i<n; i++) {
+	if(FindKey(keys[i]) < 0) return FALSE;
+	while(fread(&e, sizeof(e), 1, posIndex) == 1 && e.key == keys[i])
+	    if(e.game > 0 && e.game < hitsSize) indexHits[e.game] = TRUE;
+    }
+    return TRUE;
+}
+
 int
-GameListBuild (FILE *f)
+PositionIndexHit (int game)
+{
+    return game > 0 && game < hitsSize && indexHits[game];
+}
+
+static int
+StartGame (BuildPart *part, ListGame **listGame, int *gameNumber, long offset)
+{   // add a new game to the list of this part; returns error number, or -1 if the game belongs to the next part
+    long end = yyoffset();
+    int error;
+    if(end > part->end) { part->stop = offset; part->stopEnd = end; return -1; }
+    if(!*gameNumber) part->firstEnd = end;
+    if((error = GameListNewGame(&part->games, listGame))) return error;
+    (*listGame)->number = ++*gameNumber;
+    (*listGame)->offset = offset;
+    return 0;
+}
+
+static int
+SharedTag (char *tag)
+{   // VariantMen redefines the pieces for everyone, so threads cannot parse it concurrently
+    char *p = StrCaseStr(tag, "VariantMen"), *q = strchr(tag, '"');
+    return p && (!q || p < q);
+}
+
+/* Parse the games of one part of the file, from the position the parser is at.
+ * Returns 0 for success or error number, or -1 if the file has to be parsed by a single thread.
+ */
+static int
+ParseGames (BuildPart *part)
 {
     ChessMove cm, lastStart;
     int gameNumber;
     ListGame *currentListGame = NULL;
-    int error, scratch=100, plyNr=0, fromX, fromY, toX, toY;
-    int offset;
+    int error, plyNr=0, fromX, fromY, toX, toY;
+    long offset;
     char lastComment[MSG_SIZ], buf[MSG_SIZ];
-    TimeMark t, t2;
 
-    GetTimeMark(&t);
-    GameListFree(&gameList);
-    yynewfile(f);
     gameNumber = 0;
-    movePtr = 0;
-
     lastStart = (ChessMove) 0;
     yyskipmoves = FALSE;
     do {
-        yyboardindex = scratch;
+        yyboardindex = 100; yyboard = &part->board; // even, so that PosFlags() has white to move
 	offset = yyoffset();
 	quickFlag = plyNr + 1;
 	cm = (ChessMove) Myylex();
 	switch (cm) {
 	  case GNUChessGame:
-	    if ((error = GameListNewGame(&currentListGame))) {
-		rewind(f);
-		yyskipmoves = FALSE;
-		return(error);
-	    }
-	    currentListGame->number = ++gameNumber;
-	    currentListGame->offset = offset;
-	    if(1) { CopyBoard(boards[scratch], initialPosition); plyNr = 0; currentListGame->moves = PackGame(boards[scratch]); }
+	    if ((error = StartGame(part, &currentListGame, &gameNumber, offset)) > 0) return error;
+	    if (error) { cm = (ChessMove) 0; break; }
+	    if(1) { CopyBoard(part->board, initialPosition); plyNr = 0; currentListGame->moves = PackGame(part->board); }
+	    if(part->indexing) IndexPosition(part, part->board, TRUE, gameNumber);
 	    if (currentListGame->gameInfo.event != NULL) {
 		free(currentListGame->gameInfo.event);
 	    }
@@ -273,14 +739,10 @@ GameListBuild (FILE *f)
 	      case (ChessMove) 0:
 	      case MoveNumberOne:
 	      case XBoardGame:
-		if ((error = GameListNewGame(&currentListGame))) {
-		    rewind(f);
-		    yyskipmoves = FALSE;
-		    return(error);
-		}
-		currentListGame->number = ++gameNumber;
-		currentListGame->offset = offset;
-		if(1) { CopyBoard(boards[scratch], initialPosition); plyNr = 0; currentListGame->moves = PackGame(boards[scratch]); }
+		if ((error = StartGame(part, &currentListGame, &gameNumber, offset)) > 0) return error;
+		if (error) { cm = (ChessMove) 0; break; }
+		if(1) { CopyBoard(part->board, initialPosition); plyNr = 0; currentListGame->moves = PackGame(part->board); }
+		if(part->indexing) IndexPosition(part, part->board, TRUE, gameNumber);
 		lastStart = cm;
 		break;
 	      default:
@@ -289,28 +751,28 @@ GameListBuild (FILE *f)
 	    break;
 	  case PGNTag:
 	    lastStart = cm;
-	    if ((error = GameListNewGame(&currentListGame))) {
-		rewind(f);
-		yyskipmoves = FALSE;
-		return(error);
-	    }
-	    currentListGame->number = ++gameNumber;
-	    currentListGame->offset = offset;
+	    if ((error = StartGame(part, &currentListGame, &gameNumber, offset)) > 0) return error;
+	    if (error) { cm = (ChessMove) 0; break; }
+	    if (part->threaded && SharedTag(yy_text)) return -1;
 	    ParsePGNTag(yy_text, &currentListGame->gameInfo);
 	    do {
-		yyboardindex = 1;
+		yyboardindex = 1; yyboard = &part->tagBoard;
 		offset = yyoffset();
 		cm = (ChessMove) Myylex();
 		if (cm == PGNTag) {
+		    if (part->threaded && SharedTag(yy_text)) return -1;
 		    ParsePGNTag(yy_text, &currentListGame->gameInfo);
 		}
 	    } while (cm == PGNTag || cm == Comment);
 	    if(1) {
 		int btm=0;
-		if(currentListGame->gameInfo.fen) ParseFEN(boards[scratch], &btm, currentListGame->gameInfo.fen, FALSE);
-		else CopyBoard(boards[scratch], initialPosition);
+		if(currentListGame->gameInfo.fen) {
+		    if(part->threaded && strchr(currentListGame->gameInfo.fen, '<')) return -1; // shuffling sets globals
+		    ParseFEN(part->board, &btm, currentListGame->gameInfo.fen, FALSE);
+		} else CopyBoard(part->board, initialPosition);
 		plyNr = (btm != 0);
-		currentListGame->moves = PackGame(boards[scratch]);
+		currentListGame->moves = PackGame(part->board);
+		if(part->indexing) IndexPosition(part, part->board, !plyNr, gameNumber);
 	    }
 	    if(cm != NormalMove) break;
 	  case IllegalMove:
@@ -319,14 +781,10 @@ GameListBuild (FILE *f)
 	    /* Allow the first game to start with an unnumbered move */
 	    yyskipmoves = FALSE;
 	    if (lastStart == (ChessMove) 0) {
-	      if ((error = GameListNewGame(&currentListGame))) {
-		rewind(f);
-		yyskipmoves = FALSE;
-		return(error);
-	      }
-	      currentListGame->number = ++gameNumber;
-	      currentListGame->offset = offset;
-	      if(1) { CopyBoard(boards[scratch], initialPosition); plyNr = 0; currentListGame->moves = PackGame(boards[scratch]); }
+	      if ((error = StartGame(part, &currentListGame, &gameNumber, offset)) > 0) return error;
+	      if (error) { cm = (ChessMove) 0; break; }
+	      if(1) { CopyBoard(part->board, initialPosition); plyNr = 0; currentListGame->moves = PackGame(part->board); }
+	      if(part->indexing) IndexPosition(part, part->board, TRUE, gameNumber);
 	      lastStart = MoveNumberOne;
 	    }
 	  case WhiteCapturesEnPassant:
@@ -352,8 +810,10 @@ GameListBuild (FILE *f)
 		toX = currentMoveString[2] - AAA;
 		toY = currentMoveString[3] - ONE;
 		plyNr++;
-		ApplyMove(fromX, fromY, toX, toY, currentMoveString[4], boards[scratch]);
-		if(currentListGame && currentListGame->moves) PackMove(fromX, fromY, toX, toY, boards[scratch][toY][toX]);
+		ApplyMove(fromX, fromY, toX, toY, currentMoveString[4], part->board);
+		if(currentListGame && currentListGame->moves && !PackMove(fromX, fromY, toX, toY, part->board[toY][toX]))
+		    currentListGame->moves = 0; // too long to cache; search must replay it
+		if(part->indexing && currentListGame) IndexPosition(part, part->board, !(plyNr & 1), gameNumber);
 	    break;
         case WhiteWins: // [HGM] rescom: save last comment as result details
         case BlackWins:
@@ -375,16 +835,260 @@ GameListBuild (FILE *f)
 	  default:
 	    break;
 	}
-	if(gameNumber % 1000 == 0) {
+	if(!part->threaded && gameNumber % 1000 == 0) {
 	    snprintf(buf, MSG_SIZ, _("Reading game file (%d)"), gameNumber);
 	    DisplayTitle(buf); DoEvents();
 	}
     }
     while (cm != (ChessMove) 0);
+    return 0;
+}
+
+static BuildPart *
+NewParts (int n, int indexing)
+{
+    BuildPart *parts = (BuildPart *) calloc(n, sizeof(BuildPart));
+    int i;
+    if(!parts) return NULL;
+    for(i=0; i<n; i++) {
+	ListNew(&parts[i].games);
+	parts[i].indexing = indexing;
+	parts[i].end = 0x7FFFFFFF; // only the last part runs to the end of the file
+	parts[i].stopEnd = -1;     // meaning it did
+	parts[i].firstEnd = -2;
+    }
+    return parts;
+}
+
+static void
+FreeParts (BuildPart *parts, int n)
+{
+    int i;
+    if(!parts) return;
+    for(i=0; i<n; i++) GameListFree(&parts[i].games), free(parts[i].index);
+    free(parts);
+}
+
+static void
+JoinParts (BuildPart *parts, int n)
+{   // append the games and index entries of all parts to the game list, numbering the games consecutively
+    int i, j, base = gameList.head->succ ? ((ListGame *) gameList.tailPred)->number : 0;
+    for(i=0; i<n; i++) {
+	BuildPart *part = parts + i;
+	if(part->indexSize < 0) indexSize = -1; // part could not be indexed, so neither can the file
+	else if(!indexBuf && base == 0) { // take over the buffer
+	    indexBuf = part->index; indexNr = part->indexNr; indexSize = part->indexSize;
+	    part->index = NULL;
+	} else if(indexSize >= 0 && part->indexNr) {
+	    if(indexNr + part->indexNr > indexSize) {
+		IndexEntry *p = (IndexEntry *) realloc(indexBuf, (indexNr + part->indexNr) * sizeof(IndexEntry));
+		if(!p) { free(indexBuf); indexBuf = NULL; indexSize = -1; }
+		else indexBuf = p, indexSize = indexNr + part->indexNr;
+	    }
+	    if(indexSize > 0) for(j=0; j<part->indexNr; j++) {
+		indexBuf[indexNr].key = part->index[j].key;
+		indexBuf[indexNr++].game = part->index[j].game + base;
+	    }
+	}
+	while(!ListEmpty(&part->games)) {
+	    ListGame *lg = (ListGame *) part->games.head;
+	    if(i && lg->number == 1) lg->offset = parts[i-1].stop; // where a single parse would have put it
+	    lg->number += base;
+	    ListRemove((ListNode *) lg);
+	    ListAddTail(&gameList, (ListNode *) lg);
+	}
+	if(gameList.head->succ) base = ((ListGame *) gameList.tailPred)->number;
+    }
+}
 
- if(currentListGame) {
-    if(!currentListGame->moves) DisplayError("Game cache overflowed\nPosition-searching might not work properly", 0);
+#if USE_THREADS
+static long
+NextPart (char *map, long pos, long size)
+{   // find a game after pos that starts with an Event tag, which is not preceded by other tags
+    char *p = map + pos, *end = map + size, *q;
+    while(p < end && (p = memchr(p, '\n', end - p))) {
+	if(end - ++p > 7 && !strncmp(p, "[Event ", 7)) {
+	    for(q = p-1; q > map && (*q == '\n' || *q == '\r' || *q == ' ' || *q == '\t'); q--);
+	    if(*q != ']') return q + 1 - map; // part starts where the previous game ended
+	}
+    }
+    return size;
+}
+
+static int
+SplitFile (BuildPart **partsPtr, int indexing)
+{   // cut the part of the game file loaded in memory into parts for parallel parsing; returns number of parts
+    BuildPart *parts;
+    long start, end, size, pos;
+    char *map = yymapping(&start, &end);
+    int i, k, n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(!map || end > 0x7FFFFFFF) return 0; // offsets are kept in int
+    size = end - start; // map holds the file from offset start on
+    if(n > MAX_PARTS) n = MAX_PARTS;
+    if(n > size / MIN_PART) n = size / MIN_PART;
+    if(n < 2 || !(*partsPtr = parts = NewParts(n, indexing))) return 0;
+    parts[0].start = start;
+    for(i=k=1; k<n; k++) {
+	pos = start + NextPart(map, size / n * k, size);
+	if(pos >= end) break;
+	if(pos <= parts[i-1].start) continue; // previous cut was already beyond this one
+	parts[i].start = parts[i-1].end = pos; i++;
+    }
+    n = i;
+    for(i=0; i<n; i++) {
+	parts[i].threaded = TRUE;
+	memcpy(parts[i].castlingRank, castlingRank, sizeof(castlingRank));
+	memcpy(parts[i].initialRights, initialRights, sizeof(initialRights));
+    }
+    return n;
+}
+
+static void *
+BuildWorker (void *arg)
+{
+    BuildPart *part = (BuildPart *) arg;
+    memcpy(castlingRank, part->castlingRank, sizeof(castlingRank));
+    memcpy(initialRights, part->initialRights, sizeof(initialRights));
+    yynewoffset(part->start);
+    part->error = ParseGames(part);
+    quickFlag = 0;
+    PackEnd();
+    FreeLegalMoves();
+    return NULL;
+}
 
+static int
+RunParts (BuildPart *parts, int n)
+{   // parse all parts in parallel; returns error number, or -1 if the file must be parsed by one thread after all
+    pthread_t tid[MAX_PARTS];
+    int i, j;
+    for(i=0; i<n; i++) {
+	CopyBoard(parts[i].tagBoard, boards[1]); // parsing between tags uses this board
+	if(pthread_create(&tid[i], NULL, BuildWorker, (void *) (parts + i))) break;
+    }
+    for(j=0; j<i; j++) pthread_join(tid[j], NULL);
+    if(i < n) return -1;
+    for(i=0; i<n; i++) if(parts[i].error) return parts[i].error;
+    for(i=1; i<n; i++) {
+	if(parts[i-1].stopEnd < 0) { // previous part ran to the end of the file, (e.g. unterminated comment)
+	    for(j=i; j<n; j++) GameListFree(&parts[j].games), parts[j].indexNr = 0; // so later parts were never reached
+	    break;
+	}
+	if(parts[i-1].stopEnd != parts[i].firstEnd) return -1; // cut was not at a game start, e.g. in a comment
+    }
+    return 0;
+}
+#endif
+
+static int
+ReadTail (FILE *f, s64 size, char *buf)
+{
+    int len = size < TAIL_SIZE ? size : TAIL_SIZE;
+    if(fseek(f, size - len, SEEK_SET) || fread(buf, 1, len, f) != len) return -1;
+    return len;
+}
+
+static int
+CheckSource (FILE *f, char *name)
+{   // returns 0 if the list must be built from scratch, 1 if the file did not change, 2 if it grew
+    ListSource *s = &newSource;
+    char buf[TAIL_SIZE];
+    s->tailLen = 0; // marks it unusable
+    if(!name || strlen(name) >= MSG_SIZ || fstat(fileno(f), &s->st) || !S_ISREG(s->st.st_mode)) return 0;
+    safeStrCpy(s->name, name, MSG_SIZ);
+    s->variant = gameInfo.variant; s->width = BOARD_WIDTH; s->height = BOARD_HEIGHT;
+    s->legality = appData.testLegality; // all these affect the parsing
+    if((s->tailLen = ReadTail(f, s->st.st_size, s->tail)) < 0) return 0;
+    s = &listSource;
+    if(s->tailLen <= 0 || !gameList.head->succ || strcmp(s->name, newSource.name) ||
+       s->st.st_dev != newSource.st.st_dev || s->st.st_ino != newSource.st.st_ino ||
+       s->variant != newSource.variant || s->width != newSource.width || s->height != newSource.height ||
+       s->legality != newSource.legality || s->st.st_size > newSource.st.st_size) return 0;
+    if(s->st.st_size == newSource.st.st_size) return s->st.st_mtime == newSource.st.st_mtime;
+    return ReadTail(f, s->st.st_size, buf) == s->tailLen && !memcmp(buf, s->tail, s->tailLen) ? 2 : 0;
+}
+
+/* Build the list of games in the open file f.
+ * Returns 0 for success or error number.
+ * If a name is given, the position index of that file is opened or created,
+ * and when the list was last built from the same file, only what was appended to it is parsed.
+ */
+int
+GameListBuild (FILE *f, char *name)
+{
+    ListGame *currentListGame;
+    BuildPart *parts = NULL;
+    int error = -1, n = 0, refresh, keep = 0, resume = 0;
+    long from = ftell(f);
+    TimeMark t, t2;
+    Boolean indexing = FALSE;
+
+    GetTimeMark(&t);
+    free(indexBuf); indexBuf = NULL; indexNr = indexSize = 0; // in case an earlier build was aborted
+    refresh = CheckSource(f, name);
+    if(refresh && appData.positionIndex && !posIndex) refresh = 0; // index can only be made from all games
+    if(refresh == 1) { // nothing to do
+	if(!appData.positionIndex && posIndex) fclose(posIndex), posIndex = NULL;
+	if(appData.debugMode) fprintf(debugFP, "GameListBuild: %s unchanged\n", name);
+	rewind(f);
+	return 0;
+    }
+    if(refresh) { // continue from the last game, which might have been incomplete
+	currentListGame = (ListGame *) gameList.tailPred;
+	from = currentListGame->offset; resume = currentListGame->moves; keep = currentListGame->number;
+	GameListDeleteGame(currentListGame);
+	if(tagRows >= keep) tagRows = keep - 1;
+	if((indexing = appData.positionIndex)) indexHeader.size = newSource.st.st_size, indexHeader.mtime = newSource.st.st_mtime;
+	else if(posIndex) fclose(posIndex), posIndex = NULL;
+    } else {
+	GameListFree(&gameList);
+	TagIndexClear();
+	if(appData.positionIndex) indexing = !OpenPositionIndex(f, name) && indexName[0];
+	else if(posIndex) fclose(posIndex), posIndex = NULL;
+    }
+    listSource.tailLen = 0; // until the build succeeds
+    fseek(f, from, SEEK_SET);
+    yymapfile(f, -1); // parse what is left of the file from memory, if it fits
+    if(keep) PackResume(resume); else PackReset();
+
+#if USE_THREADS
+    if((n = SplitFile(&parts, indexing)) > 1) error = RunParts(parts, n);
+#endif
+    if(error < 0) { // parse the file in a single thread
+	if(n > 1) { // start over
+	    fseek(f, from, SEEK_SET);
+	    yynewfile(f);
+	    if(keep) PackResume(resume); else PackReset();
+	}
+	FreeParts(parts, n);
+	n = 1;
+	if(!(parts = NewParts(n, indexing))) error = ENOMEM; else {
+	    CopyBoard(parts[0].tagBoard, boards[1]);
+	    error = ParseGames(parts);
+	    yyboard = NULL;
+	    quickFlag = 0;
+	    PackEnd(); // for appending end-of-game marker.
+	}
+    }
+    if(!error) JoinParts(parts, n);
+    FreeParts(parts, n);
+    if(error) {
+	GameListFree(&gameList);
+	tagRows = 0;
+	free(indexBuf); indexBuf = NULL; indexNr = indexSize = 0;
+	if(keep && posIndex) fclose(posIndex), posIndex = NULL; // does not match the file anymore
+	yyunmap();
+	rewind(f);
+	yyskipmoves = FALSE;
+	return(error);
+    }
+    listSource = newSource; // as CheckSource() found the file before parsing it
+    TagIndexUpdate();
+
+ if(gameList.head->succ) {
     if (appData.debugMode) {
 	for (currentListGame = (ListGame *) gameList.head;
 	     currentListGame->node.succ;
@@ -396,10 +1100,10 @@ GameListBuild (FILE *f)
 	}
     }
   }
-    if(appData.debugMode) { GetTimeMark(&t2);printf("GameListBuild %ld msec\n", SubtractTimeMarks(&t2,&t)); }
-    quickFlag = 0;
-    PackGame(boards[scratch]); // for appending end-of-game marker.
+    if(appData.debugMode) { GetTimeMark(&t2);printf("GameListBuild %ld msec (%d threads, from game %d)\n", SubtractTimeMarks(&t2,&t), n, keep); }
+    if(indexing) WritePositionIndex(keep);
     DisplayTitle("WinBoard");
+    yyunmap();
     rewind(f);
     yyskipmoves = FALSE;
     return 0;
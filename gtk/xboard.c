@@ -887,6 +887,21 @@ main (int argc, char **argv)
 	exit(0);
     }
 
+    // [HGM] batch jobs are handled before the toolkit is initialized, so that they do not need a display
+    if(argc > 2 && !strcmp(argv[1], "-compactBook")) { // [HGM] compact: batch job, no GUI needed
+	int before, after = CompactBookFile(argv[2], argc > 3 ? atoi(argv[3]) : 0, &before);
+	if(after < 0) { fprintf(stderr, _("%s: could not compact book %s\n"), argv[0], argv[2]); exit(1); }
+	printf("%s: %d -> %d entries\n", argv[2], before, after);
+	exit(0);
+    }
+
+    if(argc > 2 && !strcmp(argv[1], "-perft")) { // [HGM] perft: batch job, no GUI needed
+	char *line = (argc > 3 ? ConvertToLine(argc-2, argv+2) : ""); // options after the depth
+	SetDefaultsFromList();
+	ParseArgs(StringGet, &line);
+	exit(Perft(atoi(argv[2])));
+    }
+
     /* set up GTK */
     gtk_init (&argc, &argv);
 #ifdef OSXAPP
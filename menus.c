@@ -113,7 +113,7 @@ LoadGamePopUp (FILE *f, int gameNumber, char *title)
 {
     cmailMsgLoaded = FALSE;
     if (gameNumber == 0) {
-	int error = GameListBuild(f);
+	int error = GameListBuild(f, title);
 	if (error) {
 	    DisplayError(_("Cannot build game list"), error);
 	} else if (!ListEmpty(&gameList) &&
@@ -72,7 +72,7 @@ int BlackPiece P((ChessSquare));
 int SameColor P((ChessSquare, ChessSquare));
 int PosFlags(int index);
 
-int quickFlag;
+THREAD_LOCAL int quickFlag;
 char *pieceDesc[EmptySquare];
 char *defaultDesc[EmptySquare] = {
  "fmWfceFifmnD", "N", "B", "R", "Q",
@@ -111,7 +111,7 @@ SameColor (ChessSquare piece1, ChessSquare piece2)
             (int) piece2 <  (int) EmptySquare);
 }
 #else
-#define SameColor(piece1, piece2) (piece1 < EmptySquare && piece2 < EmptySquare && (piece1 < BlackPawn) == (piece2 < BlackPawn) || piece1 == DarkSquare || piece2 == DarkSquare)
+#define SameColor(piece1, piece2) ((piece1 < EmptySquare && piece2 < EmptySquare && (piece1 < BlackPawn) == (piece2 < BlackPawn)) || piece1 == DarkSquare || piece2 == DarkSquare)
 #endif
 
 unsigned char pieceToChar[EmptySquare+1] = {
@@ -256,9 +256,9 @@ LoadPieceDesc (char *s)
 	    piece = promoPartner[piece];
 	    if(pieceToChar[piece] != '+') { ok = FALSE; continue; } // promoted form does not exist
 	}
-	ASSIGN(pieceDesc[piece], p);
+	ASSIGN(pieceDesc[piece], p); CompilePieceDesc(piece);
 	if(piece < BlackPawn && (pieceToChar[WHITE_TO_BLACK piece] == pieceToChar[piece] + 32 || promoted)) {
-	    ASSIGN(pieceDesc[WHITE_TO_BLACK piece], p);
+	    ASSIGN(pieceDesc[WHITE_TO_BLACK piece], p); CompilePieceDesc(WHITE_TO_BLACK piece);
 	}
 	pieceDefs = TRUE;
 	if(q) *q = ';';
@@ -278,6 +278,7 @@ LoadPieceDesc (char *s)
 // 2nd leg, the from-square has to be considered empty, although the moving piece is still on it.
 
 Boolean pieceDefs;
+Boolean fastGen; // [HGM] speed: set by InitPosition for variants that can use GenOrthodox
 
 //  alphabet      "abcdefghijklmnopqrstuvwxyz"
 char symmetry[] = "FBNW.FFW.NKN.NW.QR....W..N";
@@ -310,217 +311,299 @@ OK (Board board, int flags, ChessMove kind, int rf, int ff, int rt, int ft, VOID
     (*(int*)cl)++;
 }
 
-void
-MovesFromString (Board board, int flags, int f, int r, int tx, int ty, int angle, int range, char *desc, MoveCallback cb, VOIDSTAR cl)
-{
-    char buf[80], *p = desc, *atom = NULL;
-    int mine, his, dir, bit, occup, i, ep, promoRank = -1;
+// [HGM] gen: moves are generated atom by atom. How an atom is parsed does not depend on the position, so
+//       the descriptors of the pieces are parsed only once, and GenPseudoLegal works from the parsed atoms.
+typedef struct {
+    int dx, dy, expo, mode, dirSet, ds2, retry, all, initial, jump, skip;
+    char *cont;  // continuation legs (with their atom already upgraded), or NULL
+} MoveAtom;
+
+typedef struct {
+    char *desc;  // the descriptor the atoms were parsed from
+    int n;
+    MoveAtom *atom;
+} CompiledDesc;
+
+static CompiledDesc compiled[EmptySquare];
+
+static int
+ParseAtom (char **pp, MoveAtom *a, char *buf, int tx, int angle, int mine, int his)
+{   // parse the atom at *pp, and step over it; continuation legs are prepared in buf. FALSE on syntax error
+    char *p = *pp, *desc = p, *atom, *cont = NULL;
+    int expo = -1, dx, dy, mode, dirSet, ds2=0, retry=0, initial=0, jump=1, skip = 0, all = 0, i;
+    while(*p == 'i') initial++, desc = ++p;
+    while(islower(*p)) p++;  // skip prefixes
+    if(!isupper(*p)) return FALSE; // syntax error: no atom
+    dx = xStep[*p-'A'] - '0';// step vector of atom
+    dy = yStep[*p-'A'] - '0';
+    dirSet = 0;              // build direction set based on atom symmetry
+    switch(symmetry[*p-'A']) {
+      case 'B': expo = 0;    // bishop, slide
+      case 'F': all = 0xAA;  // diagonal atom (degenerate 4-fold)
+		if(tx >= 0) goto king;        // continuation legs specified in K/Q system!
+		while(islower(*desc) && (i = dirType[*desc-'a']) != '0') {
+		    int b = dirs1[*desc-'a']; // use wide version
+		    if( islower(desc[1]) &&
+			     ((i | dirType[desc[1]-'a']) & 3) == 3) {   // combinable (perpendicular dim)
+			b = dirs1[*desc-'a'] & dirs1[desc[1]-'a'];      // intersect wide & perp wide
+			desc += 2;
+		    } else desc++;
+		    dirSet |= b;
+		}
+		dirSet &= 0xAA; if(!dirSet) dirSet = 0xAA;
+		break;
+      case 'R': expo = 0;    // rook, slide
+      case 'W': all = 0x55;  // orthogonal atom (non-deg 4-fold)
+		if(tx >= 0) goto king;        // continuation legs specified in K/Q system!
+		while(islower(*desc) && (dirType[*desc-'a'] & ~4) != '0') dirSet |= dirs2[*desc++-'a'];
+		dirSet &= 0x55; if(!dirSet) dirSet = 0x55;
+		dirSet = (dirSet << angle | dirSet >> 8-angle) & 255;   // re-orient direction system
+		break;
+      case 'N': all = 0xFF;  // oblique atom (degenerate 8-fold)
+		if(tx >= 0) goto king;        // continuation legs specified in K/Q system!
+		if(*desc == 'h') {            // chiral direction sets 'hr' and 'hl'
+		    dirSet = (desc[1] == 'r' ? 0x55 :  0xAA); desc += 2;
+		} else
+		while(islower(*desc) && (i = dirType[*desc-'a']) != '0') {
+		    int b = dirs2[*desc-'a']; // when alone, use narrow version
+		    if(desc[1] == 'h') b = dirs1[*desc-'a'], desc += 2; // dirs1 is wide version
+		    else if(*desc == desc[1] || islower(desc[1]) && i < '4'
+			    && ((i | dirType[desc[1]-'a']) & 3) == 3) { // combinable (perpendicular dim or same)
+			b = dirs1[*desc-'a'] & dirs2[desc[1]-'a'];      // intersect wide & perp narrow
+			desc += 2;
+		    } else desc++;
+		    dirSet |= b;
+		}
+		if(!dirSet) dirSet = 0xFF;
+		break;
+      case 'Q': expo = 0;    // queen, slide
+      case 'K': all = 0xFF;  // non-deg (pseudo) 8-fold
+      king:
+		while(islower(*desc) && (i = dirType[*desc-'a']) != '0') {
+		    int b = dirs4[*desc-'a'];    // when alone, use narrow version
+		    if(desc[1] == *desc) desc++; // doubling forces alone
+		    else if(islower(desc[1]) && i < '4'
+			    && ((i | dirType[desc[1]-'a']) & 3) == 3) { // combinable (perpendicular dim or same)
+			b = dirs3[*desc-'a'] & dirs3[desc[1]-'a'];      // intersect wide & perp wide
+			desc += 2;
+		    } else desc++;
+		    dirSet |= b;
+		}
+		if(!dirSet) dirSet = (tx < 0 ? 0xFF                     // default is all directions, but in continuation leg
+				      : all == 0xFF ? 0xEF : 0x45);     // omits backward, and for 4-fold atoms also diags
+		dirSet = (dirSet << angle | dirSet >> 8-angle) & 255;   // re-orient direction system
+		ds2 = dirSet & 0xAA;          // extract diagonal directions
+		if(dirSet &= 0x55)            // start with orthogonal moves, if present
+		     retry = 1, dx = 0;       // and schedule the diagonal moves for later
+		else dx = dy, dirSet = ds2;   // if no orthogonal directions, do diagonal immediately
+		break;       // should not have direction indicators
+      default:  return FALSE; // syntax error: invalid atom
+    }
+    if(mine == 2 && tx < 0) dirSet = dirSet >> 4 | dirSet << 4 & 255;   // invert black moves
+    mode = 0;                // build mode mask
+    if(*desc == 'm') mode |= 4, desc++;           // move to empty
+    if(*desc == 'c') mode |= his, desc++;         // capture foe
+    if(*desc == 'd') mode |= mine, desc++;        // destroy (capture friend)
+    if(*desc == 'e') mode |= 8, desc++;           // e.p. capture last mover
+    if(*desc == 't') mode |= 16, desc++;          // exclude enemies as hop platform ('test')
+    if(*desc == 'p') mode |= 32, desc++;          // hop over occupied
+    if(*desc == 'g') mode |= 64, desc++;          // hop and toggle range
+    if(*desc == 'o') mode |= 128, desc++;         // wrap around cylinder board
+    if(*desc == 'y') mode |= 512, desc++;         // toggle range on empty square
+    if(*desc == 'n') jump = 0, desc++;            // non-jumping
+    while(*desc == 'j') jump++, desc++;           // must jump (on B,R,Q: skip first square)
+    if(*desc == 'a') cont = ++desc;               // move again after doing what preceded it
+    if(isdigit(*++p)) expo = atoi(p++);           // read exponent
+    if(expo > 9) p++;                             // allow double-digit
+    *pp = p;
+    if(expo > 0 && dx == 0 && dy == 0) {          // castling indicated by O + number
+	mode |= 1024; dy = 1;
+    }
+    if(expo < 0) expo = 1;                        // use 1 for default
+    if(!cont) {
+	if(!(mode & 15)) mode |= his + 4;         // no mode spec, use default = mc
+    } else {
+	strncpy(buf, cont, 80); cont = buf;       // copy next leg(s), so we can modify
+	atom = buf; while(islower(*atom)) atom++; // skip to atom
+	if(mode & 32) mode ^= 256 + 32;           // in non-final legs 'p' means 'pass through'
+	if(mode & 64 + 512) {
+	    mode |= 256;                          // and 'g' too, but converts leaper <-> slider
+	    if(mode & 512) mode ^= 0x304;         // and 'y' is m-like 'g'
+	    *atom = upgrade[*atom-'A'];           // replace atom, BRQ <-> FWK
+	    atom[1] = atom[2] = '\0';             // make sure any old range is stripped off
+	    if(expo == 1) atom[1] = '0';          // turn other leapers into riders 
+	}
+	if(!(mode & 0x30F)) mode |= 4;            // and default of this leg = m
+    }
+    if(dy == 1) skip = jump - 1, jump = 1;        // on W & F atoms 'j' = skip first square
+    a->dx = dx; a->dy = dy; a->expo = expo; a->mode = mode; a->cont = cont;
+    a->dirSet = dirSet; a->ds2 = ds2; a->retry = retry; a->all = all;
+    a->initial = initial; a->jump = jump; a->skip = skip;
+    return TRUE;
+}
+
+static void MovesFromString P((Board board, int flags, int f, int r, int tx, int ty, int angle, int range,
+			       char *desc, MoveCallback cb, VOIDSTAR cl)); // continuation legs recurse into it
+
+static void
+AtomMoves (Board board, int flags, int f, int r, int tx, int ty, int range, MoveAtom *a, MoveCallback cb, VOIDSTAR cl)
+{   // generate the moves of a parsed atom
+    char *cont = a->cont, *atom = NULL;
+    int mine, his, dir, bit, occup, ep, x, y, promoRank = -1;
+    int expo = a->expo, dx = a->dx, dy = a->dy, mode = a->mode, dirSet = a->dirSet, ds2 = a->ds2, retry = a->retry;
+    int all = a->all, initial = a->initial, jump = a->jump, skip = a->skip;
     ChessMove promo= NormalMove; ChessSquare pc = board[r][f];
-    if(pc == DarkSquare) return; // this is not a piece, but a 'hole' in the board
     if(flags & F_WHITE_ON_MOVE) his = 2, mine = 1; else his = 1, mine = 2;
     if(pc == WhitePawn || pc == WhiteLance) promo = WhitePromotion, promoRank = BOARD_HEIGHT-1; else
     if(pc == BlackPawn || pc == BlackLance) promo = BlackPromotion, promoRank = 0;
-    while(*p) {                  // more moves to go
-	int expo = -1, dx, dy, x, y, mode, dirSet, ds2=0, retry=0, initial=0, jump=1, skip = 0, all = 0;
-	char *cont = NULL;
-	while(*p == 'i') initial++, desc = ++p;
-	while(islower(*p)) p++;  // skip prefixes
-	if(!isupper(*p)) return; // syntax error: no atom
-	dx = xStep[*p-'A'] - '0';// step vector of atom
-	dy = yStep[*p-'A'] - '0';
-	dirSet = 0;              // build direction set based on atom symmetry
-	switch(symmetry[*p-'A']) {
-	  case 'B': expo = 0;    // bishop, slide
-	  case 'F': all = 0xAA;  // diagonal atom (degenerate 4-fold)
-		    if(tx >= 0) goto king;        // continuation legs specified in K/Q system!
-		    while(islower(*desc) && (i = dirType[*desc-'a']) != '0') {
-			int b = dirs1[*desc-'a']; // use wide version
-			if( islower(desc[1]) &&
-				 ((i | dirType[desc[1]-'a']) & 3) == 3) {   // combinable (perpendicular dim)
-			    b = dirs1[*desc-'a'] & dirs1[desc[1]-'a'];      // intersect wide & perp wide
-			    desc += 2;
-			} else desc++;
-			dirSet |= b;
-		    }
-		    dirSet &= 0xAA; if(!dirSet) dirSet = 0xAA;
-		    break;
-	  case 'R': expo = 0;    // rook, slide
-	  case 'W': all = 0x55;  // orthogonal atom (non-deg 4-fold)
-		    if(tx >= 0) goto king;        // continuation legs specified in K/Q system!
-		    while(islower(*desc) && (dirType[*desc-'a'] & ~4) != '0') dirSet |= dirs2[*desc++-'a'];
-		    dirSet &= 0x55; if(!dirSet) dirSet = 0x55;
-		    dirSet = (dirSet << angle | dirSet >> 8-angle) & 255;   // re-orient direction system
-		    break;
-	  case 'N': all = 0xFF;  // oblique atom (degenerate 8-fold)
-		    if(tx >= 0) goto king;        // continuation legs specified in K/Q system!
-		    if(*desc == 'h') {            // chiral direction sets 'hr' and 'hl'
-			dirSet = (desc[1] == 'r' ? 0x55 :  0xAA); desc += 2;
- 		    } else
-		    while(islower(*desc) && (i = dirType[*desc-'a']) != '0') {
-			int b = dirs2[*desc-'a']; // when alone, use narrow version
-			if(desc[1] == 'h') b = dirs1[*desc-'a'], desc += 2; // dirs1 is wide version
-			else if(*desc == desc[1] || islower(desc[1]) && i < '4'
-				&& ((i | dirType[desc[1]-'a']) & 3) == 3) { // combinable (perpendicular dim or same)
-			    b = dirs1[*desc-'a'] & dirs2[desc[1]-'a'];      // intersect wide & perp narrow
-			    desc += 2;
-			} else desc++;
-			dirSet |= b;
-		    }
-		    if(!dirSet) dirSet = 0xFF;
-		    break;
-	  case 'Q': expo = 0;    // queen, slide
-	  case 'K': all = 0xFF;  // non-deg (pseudo) 8-fold
-	  king:
-		    while(islower(*desc) && (i = dirType[*desc-'a']) != '0') {
-			int b = dirs4[*desc-'a'];    // when alone, use narrow version
-			if(desc[1] == *desc) desc++; // doubling forces alone
-			else if(islower(desc[1]) && i < '4'
-				&& ((i | dirType[desc[1]-'a']) & 3) == 3) { // combinable (perpendicular dim or same)
-			    b = dirs3[*desc-'a'] & dirs3[desc[1]-'a'];      // intersect wide & perp wide
-			    desc += 2;
-			} else desc++;
-			dirSet |= b;
-		    }
-		    if(!dirSet) dirSet = (tx < 0 ? 0xFF                     // default is all directions, but in continuation leg
-					  : all == 0xFF ? 0xEF : 0x45);     // omits backward, and for 4-fold atoms also diags
-		    dirSet = (dirSet << angle | dirSet >> 8-angle) & 255;   // re-orient direction system
-		    ds2 = dirSet & 0xAA;          // extract diagonal directions
-		    if(dirSet &= 0x55)            // start with orthogonal moves, if present
-		         retry = 1, dx = 0;       // and schedule the diagonal moves for later
-		    else dx = dy, dirSet = ds2;   // if no orthogonal directions, do diagonal immediately
-		    break;       // should not have direction indicators
-	  default:  return;      // syntax error: invalid atom
-	}
-	if(mine == 2 && tx < 0) dirSet = dirSet >> 4 | dirSet << 4 & 255;   // invert black moves
-	mode = 0;                // build mode mask
-	if(*desc == 'm') mode |= 4, desc++;           // move to empty
-	if(*desc == 'c') mode |= his, desc++;         // capture foe
-	if(*desc == 'd') mode |= mine, desc++;        // destroy (capture friend)
-	if(*desc == 'e') mode |= 8, desc++;           // e.p. capture last mover
-	if(*desc == 't') mode |= 16, desc++;          // exclude enemies as hop platform ('test')
-	if(*desc == 'p') mode |= 32, desc++;          // hop over occupied
-	if(*desc == 'g') mode |= 64, desc++;          // hop and toggle range
-	if(*desc == 'o') mode |= 128, desc++;         // wrap around cylinder board
-	if(*desc == 'y') mode |= 512, desc++;         // toggle range on empty square
-	if(*desc == 'n') jump = 0, desc++;            // non-jumping
-	while(*desc == 'j') jump++, desc++;           // must jump (on B,R,Q: skip first square)
-	if(*desc == 'a') cont = ++desc;               // move again after doing what preceded it
-	if(isdigit(*++p)) expo = atoi(p++);           // read exponent
-	if(expo > 9) p++;                             // allow double-digit
-	desc = p;                                     // this is start of next move
-	if(initial == 2) { if(board[r][f] != initialPosition[r-2*his+3][f]) continue; initial = 0; } else
-	if(initial && !range) {
-		if(   (board[r][f] != initialPosition[r][f] ||
-		       r == 0              && board[TOUCHED_W] & 1<<f ||
-		       r == BOARD_HEIGHT-1 && board[TOUCHED_B] & 1<<f   )) continue;
-		initial = 0;
-	}
-	if(expo > 0 && dx == 0 && dy == 0) {          // castling indicated by O + number
-	    mode |= 1024; dy = 1;
-	}
-	if(expo < 0) expo = 1;                        // use 1 for default
-        if(!cont) {
-	    if(!(mode & 15)) mode |= his + 4;         // no mode spec, use default = mc
-	} else {
-	    strncpy(buf, cont, 80); cont = buf;       // copy next leg(s), so we can modify
-	    atom = buf; while(islower(*atom)) atom++; // skip to atom
-	    if(mode & 32) mode ^= 256 + 32;           // in non-final legs 'p' means 'pass through'
-	    if(mode & 64 + 512) {
-		mode |= 256;                          // and 'g' too, but converts leaper <-> slider
-		if(mode & 512) mode ^= 0x304;         // and 'y' is m-like 'g'
-		*atom = upgrade[*atom-'A'];           // replace atom, BRQ <-> FWK
-		atom[1] = atom[2] = '\0';             // make sure any old range is stripped off
-		if(expo == 1) atom[1] = '0';          // turn other leapers into riders 
-	    }
-	    if(!(mode & 0x30F)) mode |= 4;            // and default of this leg = m
-	}
-	if(dy == 1) skip = jump - 1, jump = 1;        // on W & F atoms 'j' = skip first square
-        do {
-	  for(dir=0, bit=1; dir<8; dir++, bit += bit) { // loop over directions
-	    int i = expo, j = skip, hop = mode, vx, vy, loop = 0;
-	    if(!(bit & dirSet)) continue;             // does not move in this direction
-	    if(dy != 1 || mode & 1024) j = 0;         // 
-	    vx = dx*rot[dir][0] + dy*rot[dir][1];     // rotate step vector
-	    vy = dx*rot[dir][2] + dy*rot[dir][3];
-	    if(tx < 0) x = f, y = r;                  // start square
-	    else      x = tx, y = ty;                 // from previous to-square if continuation
-	    do {                                      // traverse ray
-		x += vx; y += vy;                     // step to next square
-		if(y < 0 || y >= BOARD_HEIGHT) break; // vertically off-board: always done
-		if(x <  BOARD_LEFT) { if(mode & 128) x += BOARD_RGHT - BOARD_LEFT, loop++; else break; }
-		if(x >= BOARD_RGHT) { if(mode & 128) x -= BOARD_RGHT - BOARD_LEFT, loop++; else break; }
-		if(j) { j--; continue; }              // skip irrespective of occupation
-		if(board[y][x] == DarkSquare) break;  // black squares are supposed to be off board
-		if(!jump    && board[y - vy + vy/2][x - vx + vx/2] != EmptySquare) break; // blocked
-		if(jump > 1 && board[y - vy + vy/2][x - vx + vx/2] == EmptySquare) break; // no hop
-		if(x == f && y == r && !loop) occup = 4;     else // start square counts as empty (if not around cylinder!)
-		if(board[y][x] < BlackPawn)   occup = 0x101; else
-		if(board[y][x] < EmptySquare) occup = 0x102; else
-					      occup = 4;
-		if(initial && expo - i + 1 != range) { if(occup == 4) continue; else break; }
-		if(cont) {                            // non-final leg
-		  if(mode&16 && his&occup) occup &= 3;// suppress hopping foe in t-mode
-		  if(occup & mode) {                  // valid intermediate square, do continuation
-		    char origAtom = *atom;
-		    int rg = (expo != 1 ? expo - i + 1 : range);   // pass length of last *slider* leg
-		    if(!(bit & all)) *atom = rotate[*atom - 'A']; // orth-diag interconversion to make direction valid
-		    if(occup & mode & 0x104)          // no side effects, merge legs to one move
-			MovesFromString(board, flags, f, r, x, y, dir, rg, cont, cb, cl);
-		    if(occup & mode & 3 && (killX < 0 || kill2X < 0 && (legNr > 1 || killX == x && killY == y) ||
-					    (legNr == 1 ? kill2X == x && kill2Y == y : killX == x && killY == y))) {     // destructive first leg
-			int cnt = 0;
+    if(cont) for(atom = cont; islower(*atom); atom++); // skip to atom
+    if(initial == 2) { if(board[r][f] != initialPosition[r-2*his+3][f]) return; initial = 0; } else
+    if(initial && !range) {
+	    if(   (board[r][f] != initialPosition[r][f] ||
+		   r == 0              && board[TOUCHED_W] & 1<<f ||
+		   r == BOARD_HEIGHT-1 && board[TOUCHED_B] & 1<<f   )) return;
+	    initial = 0;
+    }
+    do {
+      for(dir=0, bit=1; dir<8; dir++, bit += bit) { // loop over directions
+	int i = expo, j = skip, hop = mode, vx, vy, loop = 0;
+	if(!(bit & dirSet)) continue;             // does not move in this direction
+	if(dy != 1 || mode & 1024) j = 0;         // 
+	vx = dx*rot[dir][0] + dy*rot[dir][1];     // rotate step vector
+	vy = dx*rot[dir][2] + dy*rot[dir][3];
+	if(tx < 0) x = f, y = r;                  // start square
+	else      x = tx, y = ty;                 // from previous to-square if continuation
+	do {                                      // traverse ray
+	    x += vx; y += vy;                     // step to next square
+	    if(y < 0 || y >= BOARD_HEIGHT) break; // vertically off-board: always done
+	    if(x <  BOARD_LEFT) { if(mode & 128) x += BOARD_RGHT - BOARD_LEFT, loop++; else break; }
+	    if(x >= BOARD_RGHT) { if(mode & 128) x -= BOARD_RGHT - BOARD_LEFT, loop++; else break; }
+	    if(j) { j--; continue; }              // skip irrespective of occupation
+	    if(board[y][x] == DarkSquare) break;  // black squares are supposed to be off board
+	    if(!jump    && board[y - vy + vy/2][x - vx + vx/2] != EmptySquare) break; // blocked
+	    if(jump > 1 && board[y - vy + vy/2][x - vx + vx/2] == EmptySquare) break; // no hop
+	    if(x == f && y == r && !loop) occup = 4;     else // start square counts as empty (if not around cylinder!)
+	    if(board[y][x] < BlackPawn)   occup = 0x101; else
+	    if(board[y][x] < EmptySquare) occup = 0x102; else
+					  occup = 4;
+	    if(initial && expo - i + 1 != range) { if(occup == 4) continue; else break; }
+	    if(cont) {                            // non-final leg
+	      if(mode&16 && his&occup) occup &= 3;// suppress hopping foe in t-mode
+	      if(occup & mode) {                  // valid intermediate square, do continuation
+		char origAtom = *atom;
+		int rg = (expo != 1 ? expo - i + 1 : range);   // pass length of last *slider* leg
+		if(!(bit & all)) *atom = rotate[*atom - 'A']; // orth-diag interconversion to make direction valid
+		if(occup & mode & 0x104)          // no side effects, merge legs to one move
+		    MovesFromString(board, flags, f, r, x, y, dir, rg, cont, cb, cl);
+		if(occup & mode & 3 && (killX < 0 || kill2X < 0 && (legNr > 1 || killX == x && killY == y) ||
+					(legNr == 1 ? kill2X == x && kill2Y == y : killX == x && killY == y))) {     // destructive first leg
+		    int cnt = 0;
+		    legNr <<= 1;
+		    MovesFromString(board, flags, f, r, x, y, dir, rg, cont, &OK, &cnt); // count possible continuations
+		    legNr >>= 1;
+		    if(cnt) {                                                            // and if there are
+			if(legNr & 1 ? killX < 0 : kill2X < 0) cb(board, flags, FirstLeg, r, f, y, x, cl);     // then generate their first leg
 			legNr <<= 1;
-			MovesFromString(board, flags, f, r, x, y, dir, rg, cont, &OK, &cnt); // count possible continuations
+			MovesFromString(board, flags, f, r, x, y, dir, rg, cont, cb, cl);
 			legNr >>= 1;
-			if(cnt) {                                                            // and if there are
-			    if(legNr & 1 ? killX < 0 : kill2X < 0) cb(board, flags, FirstLeg, r, f, y, x, cl);     // then generate their first leg
-			    legNr <<= 1;
-			    MovesFromString(board, flags, f, r, x, y, dir, rg, cont, cb, cl);
-			    legNr >>= 1;
-			}
 		    }
-		    *atom = origAtom;        // undo any interconversion
-		  }
-		  if(occup != 4) break;      // occupied squares always terminate the leg
-		  continue;
 		}
-		if(hop & 32+64) { if(occup != 4) { if(hop & 64 && i != 1) i = 2; hop &= 31; } continue; } // hopper
-		ep = board[EP_RANK];
-		if(mode & 8 && occup == 4 && board[EP_FILE] == x && (y == (ep & 127) || y - vy == ep - 128)) { // to e.p. square (or 2nd e.p. square)
-		    cb(board, flags, mine == 1 ? WhiteCapturesEnPassant : BlackCapturesEnPassant, r, f, y, x, cl);
+		*atom = origAtom;        // undo any interconversion
+	      }
+	      if(occup != 4) break;      // occupied squares always terminate the leg
+	      continue;
+	    }
+	    if(hop & 32+64) { if(occup != 4) { if(hop & 64 && i != 1) i = 2; hop &= 31; } continue; } // hopper
+	    ep = board[EP_RANK];
+	    if(mode & 8 && occup == 4 && board[EP_FILE] == x && (y == (ep & 127) || y - vy == ep - 128)) { // to e.p. square (or 2nd e.p. square)
+		cb(board, flags, mine == 1 ? WhiteCapturesEnPassant : BlackCapturesEnPassant, r, f, y, x, cl);
+	    }
+	    if(mode & 1024) {            // castling
+		i = 2;                   // kludge to elongate move indefinitely
+		if(occup == 4) continue; // skip empty squares
+		if((x == BOARD_LEFT + skip || x > BOARD_LEFT + skip && vx < 0 && board[y][x-1-skip] == DarkSquare)
+								&& board[y][x] == initialPosition[y][x]) { // reached initial corner piece
+		  if(pc != WhiteKing && pc != BlackKing || expo == 1) { // non-royal castling (to be entered as two-leg move via 'Rook')
+		    if(killX < 0) cb(board, flags, FirstLeg,   r, f, y, x, cl); if(killX < f)
+		    legNr <<= 1,  cb(board, flags, NormalMove, r, f, y, f - expo, cl), legNr >>= 1;
+		  } else
+		    cb(board, flags, mine == 1 ? WhiteQueenSideCastle : BlackQueenSideCastle, r, f, y, f - expo, cl);
 		}
-		if(mode & 1024) {            // castling
-		    i = 2;                   // kludge to elongate move indefinitely
-		    if(occup == 4) continue; // skip empty squares
-		    if((x == BOARD_LEFT + skip || x > BOARD_LEFT + skip && vx < 0 && board[y][x-1-skip] == DarkSquare)
-								    && board[y][x] == initialPosition[y][x]) { // reached initial corner piece
-		      if(pc != WhiteKing && pc != BlackKing || expo == 1) { // non-royal castling (to be entered as two-leg move via 'Rook')
-			if(killX < 0) cb(board, flags, FirstLeg,   r, f, y, x, cl); if(killX < f)
-			legNr <<= 1,  cb(board, flags, NormalMove, r, f, y, f - expo, cl), legNr >>= 1;
-		      } else
-			cb(board, flags, mine == 1 ? WhiteQueenSideCastle : BlackQueenSideCastle, r, f, y, f - expo, cl);
-		    }
-		    if((x == BOARD_RGHT-1-skip || x < BOARD_RGHT-1-skip && vx > 0 && board[y][x+1+skip] == DarkSquare)
-								    && board[y][x] == initialPosition[y][x]) {
-		      if(pc != WhiteKing && pc != BlackKing || expo == 1) {
-			if(killX < 0) cb(board, flags, FirstLeg,   r, f, y, x, cl); if(killX > f)
-			legNr <<= 1,  cb(board, flags, NormalMove, r, f, y, f + expo, cl), legNr >>= 1;
-		      } else
-			cb(board, flags, mine == 1 ? WhiteKingSideCastle : BlackKingSideCastle, r, f, y, f + expo, cl);
-		    }
-		    break;
+		if((x == BOARD_RGHT-1-skip || x < BOARD_RGHT-1-skip && vx > 0 && board[y][x+1+skip] == DarkSquare)
+								&& board[y][x] == initialPosition[y][x]) {
+		  if(pc != WhiteKing && pc != BlackKing || expo == 1) {
+		    if(killX < 0) cb(board, flags, FirstLeg,   r, f, y, x, cl); if(killX > f)
+		    legNr <<= 1,  cb(board, flags, NormalMove, r, f, y, f + expo, cl), legNr >>= 1;
+		  } else
+		    cb(board, flags, mine == 1 ? WhiteKingSideCastle : BlackKingSideCastle, r, f, y, f + expo, cl);
 		}
-		if(mode & 16 && (board[y][x] == WhiteKing || board[y][x] == BlackKing)) break; // tame piece, cannot capture royal
-		if(occup & mode) cb(board, flags, y == promoRank ? promo : NormalMove, r, f, y, x, cl); // allowed, generate
-		if(occup != 4) break; // not valid transit square
-	    } while(--i);
-	  }
-	  dx = dy; dirSet = ds2;      // prepare for diagonal moves of K,Q
-	} while(retry-- && ds2);      // and start doing them
-	if(tx >= 0) break;            // don't do other atoms in continuation legs
+		break;
+	    }
+	    if(mode & 16 && (board[y][x] == WhiteKing || board[y][x] == BlackKing)) break; // tame piece, cannot capture royal
+	    if(occup & mode) cb(board, flags, y == promoRank ? promo : NormalMove, r, f, y, x, cl); // allowed, generate
+	    if(occup != 4) break; // not valid transit square
+	} while(--i);
+      }
+      dx = dy; dirSet = ds2;      // prepare for diagonal moves of K,Q
+    } while(retry-- && ds2);      // and start doing them
+}
+
+static void
+MovesFromString (Board board, int flags, int f, int r, int tx, int ty, int angle, int range, char *desc, MoveCallback cb, VOIDSTAR cl)
+{
+    char buf[80], *p = desc;
+    int mine, his;
+    MoveAtom a;
+    if(board[r][f] == DarkSquare) return; // this is not a piece, but a 'hole' in the board
+    if(flags & F_WHITE_ON_MOVE) his = 2, mine = 1; else his = 1, mine = 2;
+    while(*p) {                  // more moves to go
+	if(!ParseAtom(&p, &a, buf, tx, angle, mine, his)) return;
+	AtomMoves(board, flags, f, r, tx, ty, range, &a, cb, cl);
+	if(tx >= 0) break;       // don't do other atoms in continuation legs
     }
 } // next atom
 
+void
+CompilePieceDesc (ChessSquare piece)
+{   // [HGM] gen: parse the (new) descriptor of the piece as for white, for use by PieceMoves
+    CompiledDesc *c = compiled + piece;
+    char buf[80], *p = pieceDesc[piece];
+    int i;
+    FlushLegalMoves(); // [HGM] batch: lists made with the old moves are no longer valid
+    for(i=0; i<c->n; i++) FREE(c->atom[i].cont);
+    FREE(c->atom);
+    c->atom = NULL; c->n = 0;
+    if(!(c->desc = p)) return;
+    c->atom = (MoveAtom *) malloc((strlen(p) + 1)*sizeof(MoveAtom)); // every atom takes at least one character
+    while(*p && ParseAtom(&p, c->atom + c->n, buf, -1, 0, 1, 2)) {
+	if(c->atom[c->n].cont) buf[79] = 0, c->atom[c->n].cont = strdup(buf);
+	c->n++;
+    }
+}
+
+static void
+PieceMoves (Board board, int flags, int f, int r, ChessSquare piece, MoveCallback cb, VOIDSTAR cl)
+{   // [HGM] gen: engine-defined moves of the piece, from its parsed descriptor
+    CompiledDesc *c = compiled + piece;
+    char buf[80];
+    MoveAtom a;
+    int i;
+    if(c->desc != pieceDesc[piece]) { // descriptor was not parsed in advance
+	MovesFromString(board, flags, f, r, -1, -1, 0, 0, pieceDesc[piece], cb, cl);
+	return;
+    }
+    if(board[r][f] == DarkSquare) return;
+    for(i=0; i<c->n; i++) {
+	a = c->atom[i];
+	if(!(flags & F_WHITE_ON_MOVE)) { // turn the directions around, and swap friend and foe
+	    a.dirSet = a.dirSet >> 4 | (a.dirSet << 4 & 255);
+	    a.mode = (a.mode & ~3) | (a.mode & 1) << 1 | (a.mode & 2) >> 1;
+	}
+	if(a.cont) a.cont = strcpy(buf, a.cont); // AtomMoves temporarily alters the continuation
+	AtomMoves(board, flags, f, r, -1, -1, 0, &a, cb, cl);
+    }
+}
+
 // [HGM] move generation now based on hierarchy of subroutines for rays and combinations of rays
 
 void
@@ -729,6 +812,108 @@ Knight (Board board, int flags, int rf, int ff, MoveCallback callback, VOIDSTAR
 	    }
 }
 
+// [HGM] speed: dedicated generator for the orthodox pieces on a plain 8x8 board. The steps are listed in the
+//       order the generic code below tries them, so that both generate the same moves in the same order.
+static int rookSteps[][2]   = { {1,0}, {-1,0}, {0,-1}, {0,1} };
+static int bishopSteps[][2] = { {1,-1}, {1,1}, {-1,-1}, {-1,1} };
+static int kingSteps[][2]   = { {1,1}, {1,-1}, {-1,1}, {-1,-1}, {1,0}, {-1,0}, {0,1}, {0,-1} };
+static int knightSteps[][2] = { {-1,-2}, {-2,-1}, {-1,2}, {-2,1}, {1,-2}, {2,-1}, {1,2}, {2,1} };
+
+static void
+OrthoSlide (Board board, int flags, int rf, int ff, int steps[][2], MoveCallback callback, VOIDSTAR closure)
+{
+    int d, rt, ft;
+    for(d=0; d<4; d++) {
+	for(rt = rf + steps[d][0], ft = ff + steps[d][1]; (unsigned) rt < 8 && (unsigned) ft < 8; rt += steps[d][0], ft += steps[d][1]) {
+	    if (SameColor(board[rf][ff], board[rt][ft])) break;
+	    callback(board, flags, NormalMove, rf, ff, rt, ft, closure);
+	    if (board[rt][ft] != EmptySquare) break;
+	}
+    }
+}
+
+static void
+OrthoLeap (Board board, int flags, int rf, int ff, int steps[][2], MoveCallback callback, VOIDSTAR closure)
+{
+    int d, rt, ft;
+    for(d=0; d<8; d++) {
+	rt = rf + steps[d][0]; ft = ff + steps[d][1];
+	if ((unsigned) rt < 8 && (unsigned) ft < 8 && !SameColor(board[rf][ff], board[rt][ft]))
+	    callback(board, flags, NormalMove, rf, ff, rt, ft, closure);
+    }
+}
+
+static int
+GenOrthodox (Board board, int flags, MoveCallback callback, VOIDSTAR closure, ChessSquare filter)
+{   // returns FALSE without generating anything when a piece of the side to move needs the generic code
+    int rf, ff, s, n = 0, i;
+    int epfile = (signed char)board[EP_STATUS];
+    unsigned char sqr[64];
+    ChessSquare piece, mine = (flags & F_WHITE_ON_MOVE ? WhitePawn : BlackPawn);
+
+    for (rf = 0; rf < 8; rf++) for (ff = 0; ff < 8; ff++) {
+	if((piece = board[rf][ff]) == EmptySquare || (piece < BlackPawn) != (mine == WhitePawn)) continue;
+	if((piece - mine > WhiteQueen && piece - mine != WhiteKing) || PieceToChar(piece) == '~') return FALSE;
+	if(filter == EmptySquare || piece == filter) sqr[n++] = 8*rf + ff;
+    }
+
+    for(i=0; i<n; i++) {
+	rf = sqr[i] >> 3; ff = sqr[i] & 7;
+	switch(board[rf][ff]) {
+	  case WhitePawn:
+	    if (rf < 7 && board[rf + 1][ff] == EmptySquare) {
+		callback(board, flags, rf == 6 ? WhitePromotion : NormalMove, rf, ff, rf + 1, ff, closure);
+		if (rf <= 1 && board[rf + 2][ff] == EmptySquare)
+		    callback(board, flags, NormalMove, rf, ff, rf + 2, ff, closure);
+	    }
+	    for (s = -1; s <= 1; s += 2) {
+		if ((unsigned) (ff + s) >= 8) continue;
+		if (rf < 7 && ((flags & F_KRIEGSPIEL_CAPTURE) || BlackPiece(board[rf + 1][ff + s])))
+		    callback(board, flags, rf == 6 ? WhitePromotion : NormalMove, rf, ff, rf + 1, ff + s, closure);
+		if (rf == 4 && (epfile == ff + s || epfile == EP_UNKNOWN) &&
+		    board[rf][ff + s] == BlackPawn && board[rf + 1][ff + s] == EmptySquare)
+		    callback(board, flags, WhiteCapturesEnPassant, rf, ff, rf + 1, ff + s, closure);
+	    }
+	    break;
+	  case BlackPawn:
+	    if (rf > 0 && board[rf - 1][ff] == EmptySquare) {
+		callback(board, flags, rf <= 1 ? BlackPromotion : NormalMove, rf, ff, rf - 1, ff, closure);
+		if (rf >= 6 && board[rf - 2][ff] == EmptySquare)
+		    callback(board, flags, NormalMove, rf, ff, rf - 2, ff, closure);
+	    }
+	    for (s = -1; s <= 1; s += 2) {
+		if ((unsigned) (ff + s) >= 8) continue;
+		if (rf > 0 && ((flags & F_KRIEGSPIEL_CAPTURE) || WhitePiece(board[rf - 1][ff + s])))
+		    callback(board, flags, rf <= 1 ? BlackPromotion : NormalMove, rf, ff, rf - 1, ff + s, closure);
+		if (rf == 3 && (epfile == ff + s || epfile == EP_UNKNOWN) &&
+		    board[rf][ff + s] == WhitePawn && board[rf - 1][ff + s] == EmptySquare)
+		    callback(board, flags, BlackCapturesEnPassant, rf, ff, rf - 1, ff + s, closure);
+	    }
+	    break;
+	  case WhiteKnight:
+	  case BlackKnight:
+	    OrthoLeap(board, flags, rf, ff, knightSteps, callback, closure);
+	    break;
+	  case WhiteBishop:
+	  case BlackBishop:
+	    OrthoSlide(board, flags, rf, ff, bishopSteps, callback, closure);
+	    break;
+	  case WhiteQueen:
+	  case BlackQueen:
+	    OrthoSlide(board, flags, rf, ff, rookSteps, callback, closure);
+	    OrthoSlide(board, flags, rf, ff, bishopSteps, callback, closure);
+	    break;
+	  case WhiteRook:
+	  case BlackRook:
+	    OrthoSlide(board, flags, rf, ff, rookSteps, callback, closure);
+	    break;
+	  default: // King
+	    OrthoLeap(board, flags, rf, ff, kingSteps, callback, closure);
+	}
+    }
+    return TRUE;
+}
+
 /* Call callback once for each pseudo-legal move in the given
    position, except castling moves. A move is pseudo-legal if it is
    legal, or if it would be legal except that it leaves the king in
@@ -746,6 +931,9 @@ GenPseudoLegal (Board board, int flags, MoveCallback callback, VOIDSTAR closure,
     int epfile = (signed char)board[EP_STATUS]; // [HGM] gamestate: extract ep status from board
     int promoRank = gameInfo.variant == VariantMakruk || gameInfo.variant == VariantGrand || gameInfo.variant == VariantChuChess ? 3 : 1;
 
+    if(fastGen && !pieceDefs && BOARD_HEIGHT == 8 && BOARD_LEFT == 0 && BOARD_RGHT == 8 &&
+       GenOrthodox(board, flags, callback, closure, filter)) return;
+
     for (rf = 0; rf < BOARD_HEIGHT; rf++)
       for (ff = BOARD_LEFT; ff < BOARD_RGHT; ff++) {
           ChessSquare piece;
@@ -757,7 +945,7 @@ GenPseudoLegal (Board board, int flags, MoveCallback callback, VOIDSTAR closure,
                  piece = (ChessSquare) ( DEMOTED(piece) );
           if(filter != EmptySquare && piece != filter) continue;
           if(pieceDefs && pieceDesc[piece]) { // [HGM] gen: use engine-defined moves
-              MovesFromString(board, flags, ff, rf, -1, -1, 0, 0, pieceDesc[piece], callback, closure);
+              PieceMoves(board, flags, ff, rf, piece, callback, closure);
               continue;
           }
           if(IS_SHOGI(gameInfo.variant))
@@ -1424,8 +1612,65 @@ typedef struct {
     VOIDSTAR cl;
 } GenLegalClosure;
 
-int rFilter, fFilter; // [HGM] speed: sorry, but I get a bit tired of this closure madness
-Board xqCheckers, nullBoard;
+THREAD_LOCAL int rFilter, fFilter; // [HGM] speed: sorry, but I get a bit tired of this closure madness
+THREAD_LOCAL Board xqCheckers;
+Board nullBoard;
+
+// [HGM] pins: when not in check, a move can only expose the royal by vacating its from-square, as long
+//       as the opponent has no pieces for which occupying a square can open a path (hoppers, pieces
+//       that must jump, or continue after capturing). Whether vacating a square does that is found
+//       out once per piece, on its first move, and remembered in a map for the rest of GenLegal. Only
+//       for pinned pieces, the royal itself and moves with side effects the full CheckTest is needed.
+static THREAD_LOCAL unsigned int pinStamp[BOARD_RANKS][BOARD_FILES], pinGen, pinCount;
+static THREAD_LOCAL char pinned[BOARD_RANKS][BOARD_FILES];
+
+static int
+Royal (ChessSquare p, int flags)
+{   // is this the piece CheckTest guards for the side on move?
+    ChessSquare king = flags & F_WHITE_ON_MOVE ? WhiteKing : BlackKing;
+    int prince = flags & F_WHITE_ON_MOVE ? WhiteMonarch : BlackMonarch;
+    if(gameInfo.variant == VariantXiangqi)
+        king = flags & F_WHITE_ON_MOVE ? WhiteWazir : BlackWazir;
+    if(gameInfo.variant == VariantKnightmate)
+        king = flags & F_WHITE_ON_MOVE ? WhiteUnicorn : BlackUnicorn;
+    if(gameInfo.variant == VariantShogi) prince -= 11; // as in CheckTest
+    return p == king || ((gameInfo.variant == VariantChu || gameInfo.variant == VariantShogi) && p == prince);
+}
+
+static int
+PinsSuffice (Board board, int flags)
+{   // judge whether the pin map can replace CheckTest for the opponent pieces on this board
+    int r, f, royals = 0;
+    ChessSquare p;
+    char *d;
+    if(gameInfo.variant == VariantSpartan || gameInfo.variant == VariantTwoKings) return FALSE;
+    if((int)board[EP_STATUS] == EP_ROYAL_LION) return FALSE;
+    if(killX >= 0 || (int)xqCheckers[EP_STATUS]) return FALSE;
+    for(r=0; r<BOARD_HEIGHT; r++) for(f=BOARD_LEFT; f<BOARD_RGHT; f++) {
+	if((p = board[r][f]) >= EmptySquare) continue;
+	if((flags & F_WHITE_ON_MOVE) == (p < BlackPawn)) { // ours
+	    if(Royal(p, flags) && ++royals > 1) return FALSE; // lifting one would let CheckTest look at the other
+	    continue;
+	}
+	if(PieceToChar(p) == '~') p = DEMOTED(p);
+	if(pieceDefs && (d = pieceDesc[p])) { if(strpbrk(d, "agjpty")) return FALSE; } else
+	if((p == WhiteCannon || p == BlackCannon) && !IS_SHOGI(gameInfo.variant)) return FALSE;
+    }
+    return TRUE;
+}
+
+static int
+Pinned (Board board, int flags, int r, int f)
+{   // would taking the piece off this square expose our royal piece? (Also TRUE when it is the royal.)
+    ChessSquare piece = board[r][f];
+    if(pinStamp[r][f] != pinGen) {
+	board[r][f] = EmptySquare;
+	pinned[r][f] = (CheckTest(board, flags, -1, -1, -1, -1, FALSE) != 0);
+	board[r][f] = piece;
+	pinStamp[r][f] = pinGen;
+    }
+    return pinned[r][f];
+}
 
 extern void GenLegalCallback P((Board board, int flags, ChessMove kind,
 				int rf, int ff, int rt, int ft,
@@ -1451,6 +1696,12 @@ GenLegalCallback (Board board, int flags, ChessMove kind, int rf, int ff, int rt
 	    else
 		board[rf][ff] = BlackKing; // [HGM] spartan: promote to King before check-test
 	}
+	if(pinGen && !promo && kind != WhiteCapturesEnPassant && kind != BlackCapturesEnPassant
+	   && board[rt][ft] != WhiteLion && board[rt][ft] != BlackLion && !Royal(board[rf][ff], flags)
+	   && (board[rt][ft] >= EmptySquare || (flags & F_WHITE_ON_MOVE) != (board[rt][ft] < BlackPawn)) // no friendly capture
+	   && !Pinned(board, flags, rf, ff))
+	    check = 0; // [HGM] pins: vacating the from-square is harmless, and occupying the to-square too
+	else
 	check = CheckTest(board, flags, rf, ff, rt, ft,
 		  kind == WhiteCapturesEnPassant ||
 		  kind == BlackCapturesEnPassant);
@@ -1493,7 +1744,7 @@ int
 GenLegal (Board board, int  flags, MoveCallback callback, VOIDSTAR closure, ChessSquare filter)
 {
     GenLegalClosure cl;
-    int ff, ft, k, left, right, swap;
+    int ff, ft, k, left, right, swap, savePins = pinGen;
     int ignoreCheck = (flags & F_IGNORE_CHECK) != 0;
     ChessSquare wKing = WhiteKing, bKing = BlackKing, *castlingRights = board[CASTLING];
     int inCheck = !ignoreCheck && CheckTest(board, flags, -1, -1, -1, -1, FALSE); // kludge alert: this would mark pre-existing checkers if status==1
@@ -1503,7 +1754,10 @@ GenLegal (Board board, int  flags, MoveCallback callback, VOIDSTAR closure, Ches
     cl.cl = closure;
     xqCheckers[EP_STATUS] *= 2; // quasi: if previous CheckTest has been marking, we now set flag for suspending same checkers
     if(filter == EmptySquare) rFilter = fFilter = -1; // [HGM] speed: do not filter on square if we do not filter on piece
+    pinGen = 0; // [HGM] pins: 0 means no pin map; otherwise it tags the entries valid for this call
+    if(!ignoreCheck && !inCheck && PinsSuffice(board, flags)) pinGen = (++pinCount ? pinCount : ++pinCount);
     GenPseudoLegal(board, flags, GenLegalCallback, (VOIDSTAR) &cl, filter);
+    pinGen = savePins; // callbacks might call us recursively
 
     if (inCheck) return TRUE;
 
@@ -1676,6 +1930,116 @@ GenLegal (Board board, int  flags, MoveCallback callback, VOIDSTAR closure, Ches
     return FALSE;
 }
 
+// [HGM] batch: the legal moves of a position are generated once into a compact list, from which later queries
+//       about the same position are answered. Loading a game asks MateTest, Disambiguate, LegalityTest and
+//       CoordsToAlgebraic about every position, and otherwise each of those would run the generator again.
+#define NR_MOVE_LISTS 4
+
+static THREAD_LOCAL LegalMoveList moveLists[NR_MOVE_LISTS];
+static THREAD_LOCAL int nextMoveList;
+static int listEpoch = 1; // shared, so that changing the rules invalidates the lists of all threads
+
+void
+FlushLegalMoves ()
+{
+    listEpoch++;
+}
+
+void
+FreeLegalMoves ()
+{   // release the lists of the calling thread, e.g. before it exits
+    int i;
+    for(i=0; i<NR_MOVE_LISTS; i++) {
+	free(moveLists[i].move); moveLists[i].move = NULL;
+	moveLists[i].n = moveLists[i].max = 0; moveLists[i].valid = FALSE;
+    }
+}
+
+static void
+RecordCallback (Board board, int flags, ChessMove kind, int rf, int ff, int rt, int ft, VOIDSTAR closure)
+{
+    LegalMoveList *list = (LegalMoveList *) closure;
+    LegalMove *m;
+    if(list->n < 0) return; // ran out of memory before
+    if(list->n >= list->max) {
+	if(!(m = (LegalMove *) realloc(list->move, (list->max + 256)*sizeof(LegalMove)))) { list->n = -1; return; }
+	list->move = m; list->max += 256;
+    }
+    m = list->move + list->n++;
+    m->kind = kind; m->rf = rf; m->ff = ff; m->rt = rt; m->ft = ft;
+}
+
+static int
+SamePosition (Board a, Board b)
+{   // compare what the moves depend on: the squares (holdings included), the virgin flags, and the e.p. and castling state
+    return !memcmp(a, b, BOARD_HEIGHT*sizeof(a[0])) && !memcmp(a[VIRGIN], b[VIRGIN], sizeof(a[0])) &&
+	   !memcmp(a[CASTLING], b[CASTLING], (BOARD_FILES-9)*sizeof(ChessSquare)) && // up to the key
+	   !memcmp(&a[TOUCHED_W], &b[TOUCHED_W], 6*sizeof(ChessSquare));           // TOUCHED_W to HOLDINGS_SET
+}
+
+static LegalMoveList *
+FindMoveList (Board board, int flags)
+{
+    LegalMoveList *list;
+    int i;
+    if(killX >= 0 || (int)xqCheckers[EP_STATUS]) return NULL; // the moves then depend on more than the board
+    for(i=0; i<NR_MOVE_LISTS; i++) {
+	list = moveLists + i;
+	if(list->valid && list->epoch == listEpoch && list->flags == flags && list->defs == pieceDefs &&
+	   list->variant == gameInfo.variant && list->width == BOARD_WIDTH && list->height == BOARD_HEIGHT &&
+	   list->holdings == gameInfo.holdingsWidth && SamePosition(list->board, board) &&
+	   !memcmp(list->initial, initialPosition, BOARD_HEIGHT*sizeof(initialPosition[0]))) return list; // for initial moves
+    }
+    return NULL;
+}
+
+LegalMoveList *
+LegalMoves (Board board, int flags)
+{
+    LegalMoveList *list;
+    int i, saveR = rFilter, saveF = fFilter;
+    if(killX >= 0 || (int)xqCheckers[EP_STATUS]) return NULL;
+    if((list = FindMoveList(board, flags))) return list;
+    for(i=0; i<NR_MOVE_LISTS; i++) { // recycle the oldest list that is not in use
+	list = moveLists + nextMoveList++ % NR_MOVE_LISTS;
+	if(!list->busy) break;
+    }
+    if(list->busy) return NULL;
+    list->valid = FALSE; list->n = 0;
+    list->inCheck = GenLegal(board, flags, RecordCallback, (VOIDSTAR) list, EmptySquare);
+    rFilter = saveR; fFilter = saveF; // GenLegal cleared those
+    if(list->n < 0) return NULL; // list incomplete; the caller must use GenLegal
+    CopyBoard(list->board, board); CopyBoard(list->initial, initialPosition);
+    list->flags = flags; list->defs = pieceDefs; list->variant = gameInfo.variant; list->epoch = listEpoch;
+    list->width = BOARD_WIDTH; list->height = BOARD_HEIGHT; list->holdings = gameInfo.holdingsWidth;
+    list->valid = TRUE;
+    return list;
+}
+
+static int
+GenLegalCached (Board board, int flags, MoveCallback callback, VOIDSTAR closure, ChessSquare filter)
+{   // as GenLegal, but from the list of the position. Only a query for all moves makes a new list.
+    LegalMoveList *list = (filter == EmptySquare ? LegalMoves(board, flags) : FindMoveList(board, flags));
+    LegalMove *m;
+    ChessSquare piece;
+    int i;
+    if(!list) return GenLegal(board, flags, callback, closure, filter);
+    if(filter == EmptySquare) rFilter = fFilter = -1;
+    list->busy++; // callbacks could ask for other lists
+    for(i=0; i<list->n; i++) {
+	m = list->move + i;
+	if(filter != EmptySquare) { // skip what GenLegal would have filtered out
+	    if((rFilter >= 0 && rFilter != m->rt) || (fFilter >= 0 && fFilter != m->ft)) continue;
+	    piece = board[(int)m->rf][(int)m->ff];
+	    if(PieceToChar(piece) == '~') piece = DEMOTED(piece);
+	    if(piece != filter) continue;
+	}
+	callback(board, flags, m->kind, m->rf, m->ff, m->rt, m->ft, closure);
+    }
+    list->busy--;
+    return list->inCheck;
+}
+
 
 typedef struct {
     int rking, fking;
@@ -1889,7 +2253,7 @@ LegalityTest (Board board, int flags, int rf, int ff, int rt, int ft, int promoC
     cl.kind = IllegalMove;
     cl.captures = 0; // [HGM] losers: prepare to count legal captures.
     if(flags & F_MANDATORY_CAPTURE) filterPiece = EmptySquare; // [HGM] speed: do not filter in suicide, to find all captures
-    GenLegal(board, flags, LegalityTestCallback, (VOIDSTAR) &cl, filterPiece);
+    GenLegalCached(board, flags, LegalityTestCallback, (VOIDSTAR) &cl, filterPiece);
     if((flags & F_MANDATORY_CAPTURE) && cl.captures && board[rt][ft] == EmptySquare
 		&& cl.kind != WhiteCapturesEnPassant && cl.kind != BlackCapturesEnPassant)
 	return(IllegalMove); // [HGM] losers: if there are legal captures, non-capts are illegal
@@ -2037,7 +2401,7 @@ MateTest (Board board, int flags)
 		if(myPieces == 1) return MT_BARE;
     }
     cl.count = 0;
-    inCheck = GenLegal(board, flags, MateTestCallback, (VOIDSTAR) &cl, EmptySquare);
+    inCheck = GenLegalCached(board, flags, MateTestCallback, (VOIDSTAR) &cl, EmptySquare);
     // [HGM] 3check: yet to do!
     if (cl.count > 0) {
 	return inCheck ? MT_CHECK : MT_NONE;
@@ -2074,7 +2438,7 @@ DisambiguateCallback (Board board, int flags, ChessMove kind, int rf, int ff, in
 {
     register DisambiguateClosure *cl = (DisambiguateClosure *) closure;
     int wildCard = FALSE; ChessSquare piece = board[rf][ff];
-    extern int kifu; // in parser.c
+    extern THREAD_LOCAL int kifu; // in parser.c
 
     // [HGM] wild: for wild-card pieces rt and rf are dummies
     if(piece == WhiteFalcon || piece == BlackFalcon ||
@@ -2129,20 +2493,20 @@ Disambiguate (Board board, int flags, DisambiguateClosure *closure)
     closure->kind = ImpossibleMove;
     rFilter = closure->rtIn; // [HGM] speed: only consider moves to given to-square
     fFilter = closure->ftIn;
-    if(quickFlag) { // [HGM] speed: try without check test first, because if that is not ambiguous, we are happy
-        GenLegal(board, flags|F_IGNORE_CHECK, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn);
+    if(quickFlag && !FindMoveList(board, flags)) { // [HGM] speed: try without check test first, because if that is not ambiguous, we are happy
+        GenLegalCached(board, flags|F_IGNORE_CHECK, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn);
         if(closure->count > 1) { // gamble did not pay off. retry with check test to resolve ambiguity
             closure->count = closure->captures = 0;
             closure->rf = closure->ff = closure->rt = closure->ft = 0;
             closure->kind = ImpossibleMove;
-            GenLegal(board, flags, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn); // [HGM] speed: only pieces of requested type
+            GenLegalCached(board, flags, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn); // [HGM] speed: only pieces of requested type
         }
     } else
-    GenLegal(board, flags, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn); // [HGM] speed: only pieces of requested type
+    GenLegalCached(board, flags, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn); // [HGM] speed: only pieces of requested type
     if (closure->count == 0) {
 	/* See if it's an illegal move due to check */
         illegal = 1;
-        GenLegal(board, flags|F_IGNORE_CHECK, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn);
+        GenLegalCached(board, flags|F_IGNORE_CHECK, DisambiguateCallback, (VOIDSTAR) closure, closure->pieceIn);
 	if (closure->count == 0) {
 	    /* No, it's not even that */
 	  if(!appData.testLegality && !pieceDefs && closure->pieceIn != EmptySquare) {
@@ -2425,13 +2789,13 @@ CoordsToAlgebraic (Board board, int flags, int rf, int ff, int rt, int ft, int p
 	cl.kind = IllegalMove;
 	cl.rank = cl.file = cl.either = 0;
         c = PieceToChar(piece) ;
-        GenLegal(board, flags, CoordsToAlgebraicCallback, (VOIDSTAR) &cl, c!='~' ? piece : (DEMOTED(piece))); // [HGM] speed
+        GenLegalCached(board, flags, CoordsToAlgebraicCallback, (VOIDSTAR) &cl, c!='~' ? piece : (DEMOTED(piece))); // [HGM] speed
 
 	if (cl.kind == IllegalMove && !(flags&F_IGNORE_CHECK)) {
 	    /* Generate pretty moves for moving into check, but
 	       still return IllegalMove.
 	    */
-            GenLegal(board, flags|F_IGNORE_CHECK, CoordsToAlgebraicCallback, (VOIDSTAR) &cl, c!='~' ? piece : (DEMOTED(piece)));
+            GenLegalCached(board, flags|F_IGNORE_CHECK, CoordsToAlgebraicCallback, (VOIDSTAR) &cl, c!='~' ? piece : (DEMOTED(piece)));
 	    if (cl.kind == IllegalMove) break;
 	    cl.kind = IllegalMove;
 	}
@@ -68,6 +68,7 @@ extern int promoPartner[(int)EmptySquare];
 extern char *pieceDesc[(int)EmptySquare];
 extern Board initialPosition;
 extern Boolean pieceDefs;
+extern Boolean fastGen;
 
 typedef void (*MoveCallback) P((Board board, int flags, ChessMove kind,
 				int rf, int ff, int rt, int ft,
@@ -126,6 +127,34 @@ extern void GenPseudoLegal P((Board board, int flags,
 extern int GenLegal P((Board board, int flags,
 			MoveCallback callback, VOIDSTAR closure, ChessSquare filter));
 
+/* The moves GenLegal produces for a position, in the same order,
+   generated once and kept for further queries about that position. */
+typedef struct {
+    ChessMove kind;
+    signed char rf, ff, rt, ft;
+} LegalMove;
+
+typedef struct {
+    Board board;                 /* the position the moves are for */
+    Board initial;               /* and initialPosition, for moves of unmoved pieces */
+    int flags, variant, width, height, holdings, defs, epoch, valid;
+    int busy;                    /* moves are being replayed from it */
+    int inCheck;                 /* what GenLegal returned */
+    int n, max;
+    LegalMove *move;
+} LegalMoveList;
+
+/* Return the list of legal moves in the given position; it remains
+   valid until the next call for another position, or NULL when
+   no list is available. */
+extern LegalMoveList *LegalMoves P((Board board, int flags));
+
+/* Forget the lists, because the rules (not the board) changed. */
+extern void FlushLegalMoves P((void));
+
+/* Free the lists of the calling thread, e.g. before it exits. */
+extern void FreeLegalMoves P((void));
+
 /* If the player on move were to move from (rf, ff) to (rt, ft), would
    he leave himself in check?  Or if rf == -1, is the player on move
    in check now?  enPassant must be TRUE if the indicated move is an
@@ -182,4 +211,4 @@ ChessMove CoordsToAlgebraic P((Board board, int flags,
 			       int rf, int ff, int rt, int ft,
 			       int promoChar, char out[MOVE_LEN]));
 
-extern int quickFlag, killX, killY, kill2X, kill2Y, legNr;
+extern THREAD_LOCAL int quickFlag, killX, killY, kill2X, kill2Y, legNr;
@@ -69,13 +69,13 @@ typedef struct {
     short int w, h;
     FILE *fp;
     char *filename;
-    char **strings;
+    ListGame **selected; // the games that passed the filter; their lines are only made when shown
 } GameListClosure;
 static GameListClosure *glc = NULL;
 
 static char *filterPtr;
-static char *list[1003];
-static int listEnd;
+static char *list[1003], *lines[1000];
+static int listEnd, nrLines;
 
 static int GameListPrepare P((int byPos, int narrow));
 static void GameListReplace P((int page));
@@ -161,31 +161,33 @@ GameListCreate (char *name)
 static int
 GameListPrepare (int byPos, int narrow)
 {   // [HGM] filter: put in separate routine, to make callable from call-back
-    int nstrings;
+    int nstrings, *found = NULL, byTags;
     ListGame *lg;
-    char **st, *line;
+    char *line;
     TimeMark t, t2;
 
     GetTimeMark(&t);
-    if(st = glc->strings) while(*st) free(*st++);
+    byTags = TagFilter(filterString); // [HGM] tag index: filter on tag values rather than on list lines
     nstrings = ((ListGame *) gameList.tailPred)->number;
-    glc->strings = (char **) malloc((nstrings + 1) * sizeof(char *));
-    st = glc->strings;
+    free(glc->selected);
+    glc->selected = (ListGame **) malloc((nstrings + 1) * sizeof(ListGame *));
     lg = (ListGame *) gameList.head;
     listLength = wins = losses = draws = 0;
-    if(byPos) InitSearch();
+    if(byPos) InitSearch(), found = SearchGames(glc->fp, narrow, filterString, byTags); // filters, then searches in parallel
     while (nstrings--) {
 	int pos = -1;
 	if(!narrow || lg->position >= 0) { // only consider already selected positions when narrowing
-	  line = GameListLine(lg->number, &lg->gameInfo);
-	  if((filterString[0] == NULLCHAR || SearchPattern( line, filterString )) && (!byPos || (pos=GameContainsPosition(glc->fp, lg)) >= 0) ) {
-            *st++ = line; // [HGM] filter: make adding line conditional.
-	    listLength++;
+	  line = found || byTags || filterString[0] == NULLCHAR ? NULL : GameListLine(lg->number, &lg->gameInfo);
+	  if(found ? (pos = found[lg->number-1]) >= 0 : // the search already applied the filter
+	     (byTags ? TagFilterMatch(lg->number) : !line || SearchPattern( line, filterString )) &&
+	     (!byPos || (pos = GameContainsPosition(glc->fp, lg)) >= 0) ) {
+            glc->selected[listLength++] = lg; // [HGM] filter: make adding game conditional.
             if( lg->gameInfo.result == WhiteWins ) wins++; else
             if( lg->gameInfo.result == BlackWins ) losses++; else
             if( lg->gameInfo.result == GameIsDrawn ) draws++;
 	    if(!byPos) pos = 0; // indicate selected
 	  }
+	  free(line);
 	}
 	if(lg->number % 2000 == 0) {
 	    char buf[MSG_SIZ];
@@ -195,9 +197,9 @@ GameListPrepare (int byPos, int narrow)
 	lg->position = pos;
 	lg = (ListGame *) lg->node.succ;
     }
+    free(found);
     if(appData.debugMode) { GetTimeMark(&t2);printf("GameListPrepare %ld msec\n", SubtractTimeMarks(&t2,&t)); }
     DisplayTitle("XBoard");
-    *st = NULL;
     return listLength;
 }
 
@@ -206,10 +208,16 @@ GameListReplace (int page)
 {
   // filter: put in separate routine, to make callable from call-back
   char buf[MSG_SIZ], **st=list;
+  ListGame *lg;
   int i;
 
+  while(nrLines) free(lines[--nrLines]); // format only the lines of the page that is shown
+  for(i=0; i<1000 && page+i < listLength; i++) {
+    lg = glc->selected[page+i];
+    lines[nrLines++] = GameListLine(lg->number, &lg->gameInfo);
+  }
   if(page) *st++ = _("previous page"); else if(listLength > 1000) *st++ = "";
-  for(i=0; i<1000; i++) if( !(*st++ = glc->strings[page+i]) ) { st--; break; }
+  for(i=0; i<nrLines; i++) *st++ = lines[i];
   listEnd = st - list;
   if(page + 1000 <= listLength) *st++ = _("next page");
   *st = NULL;
@@ -265,14 +273,8 @@ GameListDestroy ()
     if (glc == NULL) return;
     EnableNamedMenuItem("File.SaveSelected", FALSE);
     PopDown(GameListDlg);
-    if (glc->strings != NULL) {
-	char **st;
-	st = glc->strings;
-	while (*st) {
-	    free(*st++);
-	}
-	free(glc->strings);
-    }
+    free(glc->selected);
+    while(nrLines) free(lines[--nrLines]);
     free(glc);
     glc = NULL;
 }
@@ -359,7 +361,7 @@ int
 SaveGameListAsText (FILE *f)
 {
     ListGame * lg = (ListGame *) gameList.head;
-    int nItem;
+    int nItem, byTags;
 
     if( !glc || ((ListGame *) gameList.tailPred)->number <= 0 ) {
       DisplayError(_("Game list not loaded or empty"), 0);
@@ -370,13 +372,16 @@ SaveGameListAsText (FILE *f)
     if( f != NULL ) {
 
         lg = (ListGame *) gameList.head;
+	byTags = TagFilter(filterString);
 
         for (nItem = 0; nItem < ((ListGame *) gameList.tailPred)->number; nItem++){
-            char * st = GameListLineFull(lg->number, &lg->gameInfo);
-	    char *line = GameListLine(lg->number, &lg->gameInfo);
-	    if(filterString[0] == NULLCHAR || SearchPattern( line, filterString ) )
-	            fprintf( f, "%s\n", st );
-	    free(st); free(line);
+	    char *line = byTags ? NULL : GameListLine(lg->number, &lg->gameInfo);
+	    if(byTags ? TagFilterMatch(lg->number) : filterString[0] == NULLCHAR || SearchPattern( line, filterString ) ) {
+	        char * st = GameListLineFull(lg->number, &lg->gameInfo);
+	        fprintf( f, "%s\n", st );
+	        free(st);
+	    }
+	    free(line);
             lg = (ListGame *) lg->node.succ;
         }
 
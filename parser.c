@@ -34,18 +34,24 @@
 
 extern Board	boards[MAX_MOVES];
 extern int	PosFlags(int nr);
-int		yyboardindex;
-int             yyskipmoves = FALSE;
-char		currentMoveString[4096]; // a bit ridiculous size?
-char *yy_text;
+THREAD_LOCAL int	yyboardindex;
+THREAD_LOCAL Board	*yyboard; // [HGM] parallel build: if set, the board to parse against instead of boards[yyboardindex]
+THREAD_LOCAL int	yyskipmoves = FALSE;
+THREAD_LOCAL char	currentMoveString[4096]; // a bit ridiculous size?
+THREAD_LOCAL char *yy_text;
 
 #define PARSEBUFSIZE 10000
-
-static FILE *inputFile;
-static char *inPtr, *parsePtr, *parseStart;
-static char inputBuf[PARSEBUFSIZE];
-static char yytext[PARSEBUFSIZE];
-static char fromString = 0, lastChar = '\n';
+#define YYBOARD (yyboard ? *yyboard : boards[yyboardindex])
+
+static THREAD_LOCAL FILE *inputFile;
+static THREAD_LOCAL char *inPtr, *parsePtr, *parseStart;
+static THREAD_LOCAL char inputBuf[PARSEBUFSIZE];
+static THREAD_LOCAL char yytext[PARSEBUFSIZE];
+static THREAD_LOCAL char fromString = 0, lastChar = '\n';
+static THREAD_LOCAL char mapActive; // [HGM] mmap: parse directly from the part of the file loaded in memory
+static char *mapBase, *mapEnd;      // that memory is shared by all threads
+static long mapStart;               // file offset of mapBase
+static FILE *mapFile;
 
 #define NOTHING 0
 #define NUMERIC 1
@@ -172,7 +178,7 @@ unsigned char kanjiTab[] = {
 
 int NextUnit P((char **p));
 
-int kifu = 0;
+THREAD_LOCAL int kifu = 0;
 
 char
 GetKanji (char **p, int start)
@@ -210,7 +216,7 @@ GetKanji (char **p, int start)
 int
 KifuMove (char **p)
 {
-    static char buf[MSG_SIZ];
+    static THREAD_LOCAL char buf[MSG_SIZ];
     char *ptr = buf+3, *q, k;
     int wom = quickFlag ? quickFlag&1 : WhiteOnMove(yyboardindex);
     k = GetKanji(p, XCO);
@@ -287,6 +293,7 @@ ReadLine ()
 {   // Read one line from the input file, and append to the buffer
     int c; char *start = inPtr;
     if(fromString) return 0; // parsing string, so the end is a hard end
+    if(mapActive) return 0;  // mapped file is already completely in memory
     if(!inputFile) return 0;
     while((c = fgetc(inputFile)) != EOF) {
 	*inPtr++ = c;
@@ -404,9 +411,13 @@ NextUnit (char **p)
 
 	if(**p == NULLCHAR) { // make sure there is something to parse
 	    if(fromString) return 0; // we are parsing string, so the end is really the end
+	    if(mapActive) { // mapped file is followed by a zero
+		if(*p >= mapEnd) return 0; // EOF
+		parseStart = (*p)++; return Nothing; // zero byte in the file itself
+	    }
 	    *p = inPtr = parseStart = inputBuf;
 	    if(!ReadLine()) return 0; // EOF
-	} else if(inPtr > inputBuf + PARSEBUFSIZE/2) { // buffer fills up with already parsed stuff
+	} else if(!mapActive && inPtr > inputBuf + PARSEBUFSIZE/2) { // buffer fills up with already parsed stuff
 	    char *q = *p, *r = inputBuf;
 	    while(*r++ = *q++);
 	    *p = inputBuf; inPtr = r - 1;
@@ -503,7 +514,7 @@ NextUnit (char **p)
 		currentMoveString[0] = piece;
 		currentMoveString[1] = '@';
 		currentMoveString[4] = NULLCHAR;
-		return LegalityTest(boards[yyboardindex], PosFlags(yyboardindex)&~F_MANDATORY_CAPTURE, fromY, fromX, toY, toX, NULLCHAR);
+		return LegalityTest(YYBOARD, PosFlags(yyboardindex)&~F_MANDATORY_CAPTURE, fromY, fromX, toY, toX, NULLCHAR);
 	    }
 	    if(type[1] == NOTHING && type[0] != NOTHING) { // there is a disambiguator
 		if(type[0] != type[2]) coord[0] = -1, type[1] = type[0], type[0] = NOTHING; // it was a rank-disambiguator
@@ -538,7 +549,7 @@ NextUnit (char **p)
 		    currentMoveString[suffix] = cl.promoCharIn = PromoSuffix(p);
 		}
 		if(type[0] != NOTHING && type[1] != NOTHING && type[3] != NOTHING) { // fully specified.
-		    ChessSquare realPiece = boards[yyboardindex][fromY][fromX];
+		    ChessSquare realPiece = YYBOARD[fromY][fromX];
 		    // Note that Disambiguate does not work for illegal moves, but flags them as impossible
 		    if(piece) { // check if correct piece indicated
 			if(PieceToChar(realPiece) == '~') realPiece = (ChessSquare) (DEMOTED(realPiece));
@@ -548,7 +559,7 @@ NextUnit (char **p)
 			if(realPiece < (wom ?  WhiteCannon : BlackCannon) && PieceToChar(PROMOTED(realPiece)) == '+') // seems to be that
 			   currentMoveString[4] = cl.promoCharIn = *(*p)++; // append promochar after all
 		    }
-		    result = LegalityTest(boards[yyboardindex], PosFlags(yyboardindex), fromY, fromX, toY, toX, cl.promoCharIn);
+		    result = LegalityTest(YYBOARD, PosFlags(yyboardindex), fromY, fromX, toY, toX, cl.promoCharIn);
 		    if (currentMoveString[4] == NULLCHAR) { // suppy missing mandatory promotion character
 		      if(result == WhitePromotion  || result == BlackPromotion) {
 		        switch(gameInfo.variant) {
@@ -569,12 +580,12 @@ NextUnit (char **p)
 		cl.ffIn = type[0] == NOTHING ? -1 : coord[0] + 'a' - AAA;
 		cl.rfIn = type[1] == NOTHING ? -1 : coord[1] + '0' - ONE;
 
-	        Disambiguate(boards[yyboardindex], PosFlags(yyboardindex), &cl);
+	        Disambiguate(YYBOARD, PosFlags(yyboardindex), &cl);
 
 		if(cl.kind == ImpossibleMove && !piece && type[1] == NOTHING // fxg5 type
 			&& toY == (wom ? 4 : 3)) { // could be improperly written e.p.
 		    cl.rtIn += wom ? 1 : -1; // shift target square to e.p. square
-		    Disambiguate(boards[yyboardindex], PosFlags(yyboardindex), &cl);
+		    Disambiguate(YYBOARD, PosFlags(yyboardindex), &cl);
 		    if((cl.kind != WhiteCapturesEnPassant && cl.kind != BlackCapturesEnPassant))
 			return ImpossibleMove; // nice try, but no cigar
 		}
@@ -610,7 +621,7 @@ badMove:// we failed to find algebraic move
 		SkipWhite(p);
 		if(**p == '"') {
 		    (*p)++;
-		    while(**p != '\n' && (*(*p)++ != '"'|| (*p)[-2] == '\\')); // look for unescaped quote
+		    while(**p && **p != '\n' && (*(*p)++ != '"'|| (*p)[-2] == '\\')); // look for unescaped quote
 		    if((*p)[-1] !='"') { *p = oldp; Scan(']', p); return Comment; } // string closing delimiter missing
 		    SkipWhite(p); if(*(*p)++ == ']') return PGNTag;
 		}
@@ -643,7 +654,7 @@ badMove:// we failed to find algebraic move
 		    king = BlackKing;
 		}
 		ff = (BOARD_WIDTH-1)>>1; // this would be d-file
-	        if (boards[yyboardindex][rf][ff] == king) {
+	        if (YYBOARD[rf][ff] == king) {
 		    /* ICS wild castling */
         	    ft = castlingType == 1 ? BOARD_LEFT+1 : (gameInfo.variant == VariantJanus ? BOARD_RGHT-2 : BOARD_RGHT-3);
 		} else {
@@ -668,7 +679,7 @@ badMove:// we failed to find algebraic move
 		sprintf(currentMoveString, "%c%c%c%c%c",ff+AAA,rf+ONE,ft+AAA,rt+ONE,promo);
 		if (appData.debugMode) fprintf(debugFP, "(%d-type) castling %d %d\n", castlingType, ff, ft);
 
-	        return (int) LegalityTest(boards[yyboardindex],
+	        return (int) LegalityTest(YYBOARD,
 			      PosFlags(yyboardindex)&~F_MANDATORY_CAPTURE, // [HGM] losers: e.p.!
 			      rf, ff, rt, ft, promo);
 	    } else if(Match("01", p)) return Nothing; // prevent this from being mistaken for move number 1
@@ -681,7 +692,7 @@ badMove:// we failed to find algebraic move
 	    return Open;
 	}
 	if(**p ==')') { (*p)++; return Close; }
-	if(**p == ';') { while(**p != '\n') (*p)++; return Comment; }
+	if(**p == ';') { while(**p && **p != '\n') (*p)++; return Comment; }
 
 
 	// ********* Comments and result messages **********************
@@ -756,7 +767,7 @@ badMove:// we failed to find algebraic move
 	    if(Match("by ", p) && (Word("repetition", p) || Word("agreement", p)) ) return GameIsDrawn;
 	    *p = oldp;
 	    if(*(*p)++ == '(') {
-		while(**p != '\n') if(*(*p)++ == ')') break;
+		while(**p && **p != '\n') if(*(*p)++ == ')') break;
 		if((*p)[-1] == ')')  return GameIsDrawn;
 	    }
 	    *p = oldp - 1; return GameIsDrawn;
@@ -779,9 +790,9 @@ badMove:// we failed to find algebraic move
 	    return Nothing;
 	}
 	if(lastChar == '\n' && (Match("# ", p) || Match("; ", p) || Match("% ", p))) {
-	    while(**p != '\n' && **p != ' ') (*p)++;
+	    while(**p && **p != '\n' && **p != ' ') (*p)++;
 	    if(**p == ' ' && (Match(" game file", p) || Match(" position file", p))) {
-		while(**p != '\n') (*p)++; // skip to EOLN
+		while(**p && **p != '\n') (*p)++; // skip to EOLN
 		return XBoardGame;
 	    }
 	    *p = oldp; // we might need to re-match the skipped stuff
@@ -802,8 +813,8 @@ badMove:// we failed to find algebraic move
 	    }
 	    if(lastChar == '\n' && Match(": ", p)) { // mail header, skip indented lines
 		do {
-		    while(**p != '\n') (*p)++;
-		    if(!ReadLine()) return Nothing; // append next line if not EOF
+		    while(**p && **p != '\n') (*p)++;
+		    if(mapActive ? !**p : !ReadLine()) return Nothing; // append next line if not EOF (mapped file has it already)
 		} while(Match("\n ", p) || Match("\n\t", p));
 	    }
 	    return Nothing;
@@ -823,17 +834,72 @@ badMove:// we failed to find algebraic move
 int
 yyoffset ()
 {
+    if(mapActive) return mapStart + (parsePtr - mapBase);
     return ftell(inputFile) - (inPtr - parsePtr); // subtract what is read but not yet parsed
 }
 
 void
 yynewfile (FILE *f)
-{   // prepare parse buffer for reading file
+{   // prepare parse buffer for reading file; parse from memory if yymapfile() loaded that part of it
+    long pos;
     inputFile = f;
     inPtr = parsePtr = inputBuf;
     fromString = 0;
     lastChar = '\n';
     *inPtr = NULLCHAR; // make sure we will start by reading a line
+    mapActive = FALSE;
+    if(mapBase && f == mapFile && (pos = ftell(f)) >= mapStart && pos <= mapStart + (mapEnd - mapBase))
+	mapActive = TRUE, parsePtr = mapBase + (pos - mapStart);
+}
+
+int
+yymapfile (FILE *f, long end)
+{   // [HGM] mmap: load the file from the current position up to end (EOF if end < 0) into memory, for parsing
+    // many games from it, possibly by several threads. Reading a copy, rather than mapping the file, means
+    // the file being truncated meanwhile cannot fault (SIGBUS). Returns FALSE if the file is parsed with stdio.
+    long pos = ftell(f), size;
+    size_t n;
+    yyunmap();
+    if(pos >= 0 && !fseek(f, 0, SEEK_END) && (size = ftell(f)) > pos) { // not for pipes
+	if(end < 0 || end > size) end = size;
+	if(end > pos && (mapBase = (char *) malloc(end - pos + 1))) {
+	    fseek(f, pos, SEEK_SET);
+	    n = fread(mapBase, 1, end - pos, f); // shorter if the file was truncated in the mean time
+	    mapBase[n] = NULLCHAR; // the parser relies on the text being followed by a zero
+	    mapEnd = mapBase + n; mapStart = pos; mapFile = f;
+	}
+    }
+    if(pos >= 0) fseek(f, pos, SEEK_SET);
+    yynewfile(f);
+    return mapActive;
+}
+
+void
+yyunmap ()
+{   // release the memory loaded by yymapfile(), after which the file is parsed with stdio again
+    free(mapBase);
+    mapBase = mapEnd = NULL; mapFile = NULL;
+    mapActive = FALSE;
+    inPtr = parsePtr = inputBuf; *inPtr = NULLCHAR; // a stdio parse resumes at the file position
+}
+
+char *
+yymapping (long *start, long *end)
+{   // [HGM] parallel build: the part of the file that yynewfile found in memory, if any, and its file offsets
+    if(!mapActive) return NULL;
+    *start = mapStart; *end = mapStart + (mapEnd - mapBase);
+    return mapBase;
+}
+
+void
+yynewoffset (long offset)
+{   // start parsing the file at the given offset from memory, in the calling thread
+    inputFile = NULL;
+    inPtr = inputBuf; *inPtr = NULLCHAR;
+    fromString = 0;
+    lastChar = '\n';
+    mapActive = TRUE;
+    parsePtr = mapBase + (offset - mapStart);
 }
 
 void
@@ -850,7 +916,7 @@ yylex ()
     int result = NextUnit(&parsePtr);
     char *p = parseStart, *q = yytext;
     if(p == yytext) return result;   // kludge to allow kanji expansion
-    while(p < parsePtr) *q++ = *p++; // copy the matched text to yytext[]
+    while(p < parsePtr && q < yytext + PARSEBUFSIZE-1) *q++ = *p++; // copy the matched text to yytext[]
     *q = NULLCHAR;
     lastChar = q[-1];
     return result;
@@ -861,7 +927,7 @@ Myylex ()
 {   // [HGM] wrapper for yylex, which treats nesting of parentheses
     int symbol, nestingLevel = 0, i=0;
     char *p;
-    static char buf[256*MSG_SIZ];
+    static THREAD_LOCAL char buf[256*MSG_SIZ];
     buf[0] = NULLCHAR;
     do { // eat away anything not at level 0
         symbol = yylex();
@@ -54,15 +54,20 @@
 
 extern void yynewfile P((FILE *f));
 extern void yynewstr P((char *s));
+extern int yymapfile P((FILE *f, long end));
+extern void yyunmap P((void));
+extern char *yymapping P((long *start, long *end));
+extern void yynewoffset P((long offset));
 extern int Myylex P((void)); // [HGM] yylex now globally invisible, all calls must use wrapper
 extern ChessMove yylexstr P((int boardIndex, char *s, char *buf, int buflen));
-extern char currentMoveString[];
-extern int yyboardindex;
-extern int yyskipmoves;  /* If TRUE, all moves are reported as AmbiguousMove
+extern THREAD_LOCAL char currentMoveString[];
+extern THREAD_LOCAL int yyboardindex;
+extern THREAD_LOCAL Board *yyboard;
+extern THREAD_LOCAL int yyskipmoves;  /* If TRUE, all moves are reported as AmbiguousMove
 			    instead of being disambiguated. */
-extern char *yy_text;  /* Needed because yytext can be either a char[]
+extern THREAD_LOCAL char *yy_text;  /* Needed because yytext can be either a char[]
 			  or a (non-constant) char* */
 extern int yyoffset P((void));
-extern unsigned char initialRights[BOARD_FILES];
-extern signed char  castlingRank[BOARD_FILES];
+extern THREAD_LOCAL unsigned char initialRights[BOARD_FILES];
+extern THREAD_LOCAL signed char  castlingRank[BOARD_FILES];
 
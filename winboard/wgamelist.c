@@ -55,8 +55,8 @@ int GameListToListBox( HWND hDlg, BOOL boReset, char * pszFilter, struct GameLis
     ListGame * lg = (ListGame *) gameList.head;
     int nItem;
     char buf[MSG_SIZ];
-    BOOL hasFilter = FALSE;
-    int count = 0;
+    BOOL hasFilter = FALSE, byTags = FALSE;
+    int count = 0, *found = NULL;
     struct GameListStats dummy;
 
     if(!hDlg) hDlg = gameListDialog; // [HGM] to allow calling from Game List Options dialog
@@ -82,7 +82,8 @@ int GameListToListBox( HWND hDlg, BOOL boReset, char * pszFilter, struct GameLis
         }
     }
 
-    if(byPos) InitSearch();
+    if(hasFilter) byTags = TagFilter(pszFilter); // [HGM] tag index: filter on tag values rather than on list lines
+    if(byPos) InitSearch(), found = SearchGames(gameFile, narrow, hasFilter ? pszFilter : NULL, byTags);
 
     for (nItem = 0; nItem < ((ListGame *) gameList.tailPred)->number; nItem++){
         char * st = NULL;
@@ -95,12 +96,16 @@ int GameListToListBox( HWND hDlg, BOOL boReset, char * pszFilter, struct GameLis
         }
 
       if(!narrow || lg->position >= 0) {
-        if( hasFilter ) {
+        if( found ) { // the search already applied the filter
+            if( (pos = found[lg->number-1]) < 0 ) skip = TRUE;
+        } else if( byTags ) {
+            if( !TagFilterMatch(lg->number) ) skip = TRUE;
+        } else if( hasFilter ) {
             st = GameListLine(lg->number, &lg->gameInfo);
 	    if( !SearchPattern( st, pszFilter) ) skip = TRUE;
         }
 
-        if( !skip && byPos) {
+        if( !skip && byPos && !found ) {
             if( (pos = GameContainsPosition(gameFile, lg)) < 0) skip = TRUE;
         }
 
@@ -128,6 +133,7 @@ int GameListToListBox( HWND hDlg, BOOL boReset, char * pszFilter, struct GameLis
         lg = (ListGame *) lg->node.succ;
     }
 
+    free(found);
     SendDlgItemMessage(hDlg, OPT_GameListText, LB_SETCURSEL, 0, 0);
     SetWindowText(hwndMain, "WinBoard");
 
@@ -4682,15 +4682,15 @@ LoadGameDialog(HWND hwnd, char* title)
 {
   UINT number = 0;
   FILE *f;
-  char fileTitle[MSG_SIZ];
+  char fileTitle[MSG_SIZ], fileName[MSG_SIZ];
   f = OpenFileDialog(hwnd, "rb", "",
  	             appData.oldSaveStyle ? "gam" : "pgn",
 		     GAME_FILT,
-		     title, &number, fileTitle, NULL);
+		     title, &number, fileTitle, fileName);
   if (f != NULL) {
     cmailMsgLoaded = FALSE;
     if (number == 0) {
-      int error = GameListBuild(f);
+      int error = GameListBuild(f, fileName);
       if (error) {
         DisplayError(_("Cannot build game list"), error);
       } else if (!ListEmpty(&gameList) &&